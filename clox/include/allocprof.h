@@ -0,0 +1,42 @@
+#ifndef clox_allocprof_h
+#define clox_allocprof_h
+
+#include "object.h"
+
+// 分配分析：--alloc-profile=PATH时每个对象分配都记到（对象类型，分配它的Lox函数和行）上，
+// 统计个数、字节数，以及活过了至少一次GC、到退出时还活着的个数，找出哪一行在制造垃圾
+
+typedef struct
+{
+    bool enabled;
+    const char* path;
+} AllocProfile;
+
+extern AllocProfile allocProfile;
+
+// 解析--alloc-profile=PATH，不认识返回false
+bool allocProfileOption(const char* arg);
+
+// 新对象，在当前栈帧的位置上记一笔
+void allocProfileObject(Obj* object, size_t size);
+
+// 刚分配的对象带的数组（字符串的字符、闭包的上值数组）算到同一个调用点上，
+// 之后才长出来的内存（实例的字段表等）不算
+void allocProfileOwned(size_t size);
+
+// 对象被清理
+void allocProfileFree(Obj* object);
+
+// 函数要释放了：它的分配点留到报告里，字节码的地址不再认
+void allocProfileRelease(ObjFunction* function);
+
+// 一轮GC结束，这一轮之前分配、没被清掉的对象算活过了一次GC
+void allocProfileCollected();
+
+// 整理堆搬完对象、旧页还没释放时调，按新地址重建对象表
+void allocProfileRelocate();
+
+// 写出报告，之后不再统计；freeVM一开始调，出错直接exit时由atexit调
+void allocProfileReport();
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef clox_bytecache_h
+#define clox_bytecache_h
+
+#include "object.h"
+
+// 字节码缓存：--cache-dir=DIR时，编译好的函数树（字节码、行号表、常量、嵌套的函数）
+// 存成DIR/<源码hash>.loxc，源码没变的下次直接读回来，不用再扫描、编译。
+// 文件头里有格式版本、指令数、整份源码的hash和长度、内容的校验和，对不上的
+// 或者读出来的字节码不合法的一律当没有，照常编译再覆盖掉
+//   头 | 函数：元数 上值数 名字 字节码 行号表 常量（函数常量递归展开）
+
+#define BYTECACHE_MAGIC         "LOXC"
+#define BYTECACHE_VERSION       1       // 改了指令的编码或者文件格式就加一
+
+// 常量的种类
+#define BYTECACHE_NUMBER        0
+#define BYTECACHE_STRING        1
+#define BYTECACHE_FUNCTION      2
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t opcodeCount;       // 加了指令旧缓存就作废
+    uint32_t reserved;
+    uint64_t sourceHash;
+    uint64_t sourceLength;
+    uint64_t payloadSize;
+    uint64_t payloadHash;
+} ByteCacheHeader;
+
+typedef struct
+{
+    const char* dir;            // NULL表示不用缓存
+} ByteCache;
+
+extern ByteCache byteCache;
+
+// 解析--cache-dir=DIR，不认识返回false
+bool byteCacheOption(const char* arg);
+
+// 有对得上的缓存就读回来，没有就编译并写缓存；编译出错返回NULL
+ObjFunction* compileCached(const char* source);
+
+#endif
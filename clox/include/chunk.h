@@ -46,14 +46,26 @@ typedef enum
     OP_SUPER_INVOKE,
 } OpCode;
 
+#define OPCODE_COUNT            (OP_SUPER_INVOKE + 1)     // 加指令时跟着改成最后一条
+
+// 行号表的一项：从offset开始的字节都属于line，直到下一项
+typedef struct
+{
+    int offset;
+    int line;
+} LineStart;
+
 // 代码
 typedef struct 
 {
     int count;              // 当前大小
     int capacity;           // 动态数组容量
     uint8_t* code;          // 代码的字节码
-    int* lines;             // 代码对应的行数
+    int lineCount;          // 行号表项数
+    int lineCapacity;
+    LineStart* lines;       // 行号表，只在行号变化的地方记一项，按offset递增
     ValueArray constants;   // 常量池
+    struct CodeArena* arena;    // 不为NULL时上面三个数组都在代码区里，见codearena.h
 } Chunk;
 
 // 初始化代码
@@ -64,5 +76,14 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line);
 void freeChunk(Chunk* chunk);
 // 向字节码块中的常量池添加常量，返回常量索引
 int addConstant(Chunk* chunk, Value value);
+// offset处的字节对应的源码行号，二分查行号表
+int getLine(Chunk* chunk, int offset);
+
+// offset处那条指令的字节数，OP_CLOSURE后面跟着的上值信息也算在内
+int instructionLength(Chunk* chunk, int offset);
+
+// 从文件读回来的字节码用：解释器不检查字节码，这里保证每条指令完整、常量下标在范围内、
+// 跳转落在指令开头、行号表有序；局部变量槽这些要做栈深分析才查得出来，坏文件靠校验和挡住
+bool verifyChunk(Chunk* chunk);
 
 #endif
\ No newline at end of file
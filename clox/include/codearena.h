@@ -0,0 +1,33 @@
+#ifndef clox_codearena_h
+#define clox_codearena_h
+
+#include "object.h"
+
+// 代码区：一段脚本编译完后，它所有函数的字节码和行号表挤进一块mmap出来的只读内存，
+// 常量挤进另一块连续的数组（整理堆时要改里面的对象引用，不能只读），
+// 各个Chunk按倍数扩容留下的空位也就一起收掉了。
+// 给了--code-layout=PROFILE（--profile写的折叠栈）时，样本多的函数排在最前面，挨在一起
+// 代码区被最后一个用它的函数释放时一起还掉。
+// 不到一页的（小脚本、REPL里的每一行）单独占一页太浪费，按实际大小从堆里申请，不设只读
+
+typedef struct CodeArena
+{
+    uint8_t* memory;            // 字节码，后面跟着行号表
+    size_t size;                // mmap的按页取整
+    bool mapped;                // mmap出来的、只读；否则是堆里的
+    Value* constants;
+    int constantCount;
+    int functions;              // 还有多少个函数在用
+} CodeArena;
+
+// 解析--code-layout=PROFILE，不认识返回false
+bool codeArenaOption(const char* arg);
+
+// 把script和它里面嵌套定义的函数搬进一块新的代码区，再登记覆盖率
+// 会分配内存，调用前script要在栈上
+void packCode(ObjFunction* script);
+
+// 一个函数不再用它的代码区了，最后一个走的时候释放
+void releaseCodeArena(CodeArena* arena);
+
+#endif
@@ -5,13 +5,29 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// 值的表示：默认NAN装箱，CMake的clox_union目标传VALUE_UNION换成带类型标签的联合体
+#if !defined(NAN_BOXING) && !defined(VALUE_UNION)
 #define NAN_BOXING                          // 优化，NAN装箱
+#endif
+// #define SMALL_INT                        // NAN装箱里给int32留一个标签，整数运算走快速通道
 
-#define DEBUG_PRINT_CODE                    // 编译打印反汇编
-// #define DEBUG_TRACE_EXECUTION            // 运行打印反汇编
-
+// 反汇编、执行跟踪、GC日志改成了命令行参数，见debug.h
 // #define DEBUG_STRESS_GC                  // GC的压力测试模式
-// #define DEBUG_LOG_GC                     // 打印GC日志
+// #define NO_PROBES                        // 去掉perf、bpftrace用的静态探针，见probes.h
+
+// #define GC_CONCURRENT                    // 后台线程并发标记（SATB写屏障）
+// #define GC_PARALLEL_MARK                 // 停顿期间多线程并行标记（工作窃取）
+// #define GC_COMPRESSED_REFS               // 对象堆放在一段保留地址里，表项和上值数组里的引用压成32位
+
+#define GC_COMPACT_THRESHOLD    0.5         // GC后对象页空槽比例超过它就在安全点整理堆
+#define GC_COMPACT_MIN_BYTES    (4 * 1024 * 1024)   // 堆太小不值得整理
+
+#define GC_MARK_THREADS     4               // 并行标记默认线程数
+#define GC_MARK_THREADS_MAX 64
+
+#if defined(GC_CONCURRENT) && defined(GC_PARALLEL_MARK)
+#error "GC_CONCURRENT and GC_PARALLEL_MARK cannot be enabled together."
+#endif
 
 #define UINT8_COUNT     (UINT8_MAX + 1)     // 最大局部变量数
 
@@ -7,6 +7,9 @@
 // 编译
 ObjFunction* compile(const char* source);
 
+// 编译中途内存不足被打断，丢掉编译器链，不然GC会顺着栈上已经失效的编译器去标记
+void abortCompile();
+
 // 标记编译用到的对象
 void markCompilerRoots();
 
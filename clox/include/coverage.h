@@ -0,0 +1,37 @@
+#ifndef clox_coverage_h
+#define clox_coverage_h
+
+#include "object.h"
+
+// 行级执行计数：--coverage=PATH时解释器换成插桩的那份循环，不是每条指令都计数，
+// 只在函数入口和跳转真正跳走时记一次（边计数），退出时按基本块推出每个块执行了多少次，
+// 再按行号摊到源码行上，写一份带计数的源码清单，没执行过的行标#####，可以当覆盖率用
+
+typedef struct
+{
+    bool enabled;
+    const char* path;           // 报告写到哪
+    char* source;               // 源码的拷贝，REPL时为NULL，只列有代码的行
+} Coverage;
+
+extern Coverage coverage;
+
+// 解析--coverage=PATH，不认识返回false
+bool coverageOption(const char* arg);
+
+// 记下源码，报告里逐行列出
+void coverageSource(const char* source);
+
+// 编译完一个函数：登记它的字节码，没被调用过的函数也能报出#####
+void coverageRegister(ObjFunction* function);
+
+// 函数要释放了：它的计数留到报告里，字节码的地址不再认
+void coverageRelease(ObjFunction* function);
+
+// 进入函数
+void coverageEnter(ObjFunction* function);
+
+// ip处的跳转指令跳走了
+void coverageJump(ObjFunction* function, uint8_t* ip);
+
+#endif
@@ -3,7 +3,20 @@
 
 #include "chunk.h"
 
+// 调试开关，启动时由命令行打开，默认全关
+typedef struct
+{
+    bool printCode;             // --disassemble：编译完每个函数打印反汇编
+    bool traceExecution;        // --trace：每条指令执行前打印栈和指令
+    bool logGC;                 // --gc-log：打印GC过程
+} DebugOptions;
+
+extern DebugOptions debugOptions;
+
+// 解析一个调试用的命令行参数，不认识返回false
+bool debugOption(const char* arg);
+
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,87 @@
+#ifndef clox_flight_h
+#define clox_flight_h
+
+#include "object.h"
+
+// 飞行记录器：--flight=PATH时把调用、返回、GC、运行时错误，以及每隔N条抽一条的指令，
+// 记成16字节的二进制事件写进固定大小的环形缓冲区，平时只是几次存储；
+// 出运行时错误或者收到致命信号时把缓冲区原样写到PATH，clox_flight用debug.c的反汇编解码
+// 函数编译完时登记一份字节码、行号和常量，事件里只记编号，解码时不依赖进程还活着
+
+#define FLIGHT_EVENTS           4096    // 环形缓冲区能存的事件数，2的幂
+#define FLIGHT_MESSAGE          256
+#define FLIGHT_MAGIC            "LOXFLT2"
+
+// 事件种类
+#define FLIGHT_CALL             1       // function：被调用的函数
+#define FLIGHT_RETURN           2       // function：返回的函数
+#define FLIGHT_INSTRUCTION      3       // function、offset：抽样的指令
+#define FLIGHT_GC_BEGIN         4       // data：GC前的堆大小，KB
+#define FLIGHT_GC_END           5       // data：GC后的堆大小，KB
+#define FLIGHT_COMPACT          6       // 整理了一次堆
+#define FLIGHT_ERROR            7       // function、offset：出错的指令
+
+// 函数登记数据里常量的种类
+#define FLIGHT_CONSTANT_NIL         0
+#define FLIGHT_CONSTANT_FALSE       1
+#define FLIGHT_CONSTANT_TRUE        2
+#define FLIGHT_CONSTANT_NUMBER      3
+#define FLIGHT_CONSTANT_STRING      4
+#define FLIGHT_CONSTANT_FUNCTION    5
+
+typedef struct
+{
+    uint8_t kind;
+    uint8_t opcode;             // FLIGHT_INSTRUCTION时的指令
+    uint16_t depth;             // 调用深度
+    uint32_t function;          // 函数编号，0表示不在Lox函数里
+    uint32_t offset;
+    uint32_t data;
+} FlightEvent;
+
+// 转储文件：头，capacity个事件（按环形缓冲区原样），再跟着函数登记的数据
+typedef struct
+{
+    char magic[8];
+    uint32_t capacity;
+    int32_t reason;             // 0是运行时错误，否则是信号编号
+    uint64_t head;              // 一共记过多少个事件，最新的那个在(head-1)%capacity
+    uint64_t symbolsSize;
+    char message[FLIGHT_MESSAGE];
+} FlightHeader;
+
+typedef struct
+{
+    bool enabled;
+    const char* path;
+    int sample;                 // 每隔多少条指令抽一条，0表示不抽
+    uint64_t head;
+    FlightEvent events[FLIGHT_EVENTS];
+} FlightRecorder;
+
+extern FlightRecorder flight;
+
+static inline void flightRecord(int kind, int depth, uint32_t function, uint32_t offset, uint32_t data)
+{
+    FlightEvent* event = &flight.events[flight.head++ & (FLIGHT_EVENTS - 1)];
+    event->kind = (uint8_t)kind;
+    event->opcode = 0;
+    event->depth = (uint16_t)depth;
+    event->function = function;
+    event->offset = offset;
+    event->data = data;
+}
+
+// 解析--flight=PATH、--flight-sample=N，不认识返回false
+bool flightOption(const char* arg);
+
+// 编译完一个函数：给它编号，记下解码要用的字节码、行号、常量
+void flightRegister(ObjFunction* function);
+
+// 抽样一条指令
+void flightInstruction(ObjFunction* function, uint8_t* ip, int depth);
+
+// 运行时错误：记下出错的指令和消息，写出转储
+void flightError(ObjFunction* function, uint8_t* ip, int depth, const char* message);
+
+#endif
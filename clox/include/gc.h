@@ -0,0 +1,62 @@
+#ifndef clox_gc_h
+#define clox_gc_h
+
+#include "common.h"
+#include "object.h"
+
+#define GC_OBJ_TYPES            (OBJ_UPVALUE + 1)
+
+// GC策略，启动时从环境变量和命令行读，命令行优先
+typedef struct
+{
+    size_t initialHeap;         // 第一次GC的阈值
+    double growFactor;          // GC后阈值 = 存活字节 * growFactor
+    size_t maxHeap;             // 堆上限，阈值不超过它，超了报内存不足，0表示不限
+    double targetPause;         // 单次停顿目标（毫秒），超了就缩短GC间隔，0表示不管
+    const char* statsPath;      // 每次GC写一行遥测，NULL表示不写
+} GCPolicy;
+
+// GC统计，累计值从启动开始算
+typedef struct
+{
+    size_t collections;
+    size_t allocations;         // 申请内存的次数（对象、定长块、动态数组扩容）
+    double totalPause;          // 毫秒
+    double maxPause;
+    double lastPause;
+    size_t totalFreedBytes;
+    size_t totalFreed[GC_OBJ_TYPES];
+    size_t cycleFreed[GC_OBJ_TYPES];    // 本轮各类型释放的对象数
+} GCStats;
+
+extern GCPolicy gcPolicy;
+extern GCStats gcStats;
+
+// 读LOX_GC_*环境变量
+void gcPolicyFromEnv();
+
+// 解析一个--gc-*命令行参数，不认识返回false
+bool gcPolicyOption(const char* arg);
+
+// 单调时钟，毫秒
+double gcNow();
+
+// 记一次不完整的停顿（并发模式开始标记时扫根）
+void gcRecordPause(double pause);
+
+// 一轮GC结束：记停顿、按策略算下一次的阈值、写一行遥测
+void gcRecordCycle(size_t bytesBefore, double markTime, double sweepTime);
+
+// 清理时对象被释放
+static inline void gcCountFreed(ObjType type)
+{
+    gcStats.cycleFreed[type]++;
+}
+
+// 按名字查统计值，没有这个名字返回false
+bool gcStatValue(const char* name, double* value);
+
+// 关闭遥测文件
+void gcCloseStats();
+
+#endif
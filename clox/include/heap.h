@@ -0,0 +1,124 @@
+#ifndef clox_heap_h
+#define clox_heap_h
+
+#include "common.h"
+#include "object.h"
+
+// 对象堆：对象从按自身大小对齐的页里分配，每页切成等大的槽
+// 每种对象类型有自己的slab（一串页），字符数组之类的定长附属内存按尺寸档位另有slab
+#define HEAP_PAGE_SHIFT         16
+#define HEAP_PAGE_SIZE          ((size_t)1 << HEAP_PAGE_SHIFT)  // 对象地址抹掉低位就是页头
+#define HEAP_GRANULE_SHIFT      4
+#define HEAP_GRANULE            ((size_t)1 << HEAP_GRANULE_SHIFT)
+#define HEAP_BITMAP_WORDS       (HEAP_PAGE_SIZE / HEAP_GRANULE / 64)
+#define HEAP_SIZE_CLASSES       16                              // 16字节一档，最大256字节
+#define HEAP_SMALL_MAX          (HEAP_SIZE_CLASSES * HEAP_GRANULE)
+#define HEAP_OBJ_TYPES          (OBJ_UPVALUE + 1)
+
+#ifdef GC_COMPRESSED_REFS
+#define HEAP_RESERVE_SIZE       ((size_t)4 << 30)               // 压缩引用以16字节为单位，32位够用，堆上限4GB
+#endif
+
+#if defined(GC_CONCURRENT) || defined(GC_PARALLEL_MARK)
+#define HEAP_ATOMIC_MARK                                        // 标记位可能被多个线程同时改
+#endif
+
+typedef struct HeapPage
+{
+    struct HeapPage* next;                  // 同一个slab的页串成链表
+    struct Slab* slab;                      // 所属slab，大对象页为NULL
+    size_t mapSize;                         // 映射大小，大对象页会超过HEAP_PAGE_SIZE
+    uint32_t slotSize;
+    uint32_t slotCount;
+    uint32_t liveCount;
+    uint32_t bump;                          // 从没用过的槽从这里开始
+    void* freeList;                         // 释放过的槽，串在槽的第一个字里
+    bool evacuating;                        // 整理时要腾空的页，槽里存的是转发地址
+    char* slots;                            // 第一个槽的地址
+    uint64_t markBits[HEAP_BITMAP_WORDS];   // 旁路标记位图，按16字节颗粒编号，只用对象起始的那一位
+    uint64_t allocBits[HEAP_BITMAP_WORDS];  // 哪些槽上有活着的对象
+} HeapPage;
+
+// 对象所在的页
+static inline HeapPage* pageOf(Obj* object)
+{
+    return (HeapPage*)((uintptr_t)object & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+}
+
+// 对象在位图中的编号
+static inline size_t granuleOf(HeapPage* page, Obj* object)
+{
+    return (size_t)((char*)object - page->slots) >> HEAP_GRANULE_SHIFT;
+}
+
+static inline bool isMarked(Obj* object)
+{
+    HeapPage* page = pageOf(object);
+    size_t granule = granuleOf(page, object);
+    #ifdef HEAP_ATOMIC_MARK
+    return (__atomic_load_n(&page->markBits[granule / 64], __ATOMIC_RELAXED) >> (granule % 64)) & 1;
+    #else
+    return (page->markBits[granule / 64] >> (granule % 64)) & 1;
+    #endif
+}
+
+// 标记对象，返回这次是不是由自己标上的
+static inline bool setMarked(Obj* object)
+{
+    HeapPage* page = pageOf(object);
+    size_t granule = granuleOf(page, object);
+    uint64_t bit = (uint64_t)1 << (granule % 64);
+    #ifdef HEAP_ATOMIC_MARK
+    return !(__atomic_fetch_or(&page->markBits[granule / 64], bit, __ATOMIC_ACQ_REL) & bit);
+    #else
+    bool wasMarked = page->markBits[granule / 64] & bit;
+    page->markBits[granule / 64] |= bit;
+    return !wasMarked;
+    #endif
+}
+
+// 对象实际占用的字节数，按颗粒向上取整
+static inline size_t heapSlotSize(size_t size)
+{
+    return (size + HEAP_GRANULE - 1) & ~(HEAP_GRANULE - 1);
+}
+
+// 从type的slab里分配一个heapSlotSize(size)大小的对象
+Obj* heapAllocate(size_t size, ObjType type);
+
+// 定长附属内存（不超过HEAP_SMALL_MAX），按尺寸档位从slab分配
+void* heapAllocateFixed(size_t size);
+void heapFreeFixed(void* pointer);
+
+// 清理：位图里分配了但没标记的对象交给finalize释放附属内存，槽回收，空页还给系统。返回释放的字节数
+size_t heapSweep(void (*finalize)(Obj*));
+
+// 虚拟机退出：附属内存交给finalize，然后整页释放
+void freeHeap(void (*finalize)(Obj*));
+
+// 对象页里空槽的比例
+double heapFragmentation();
+
+// 整理第一步：每个slab挑出稀疏的页准备腾空，没有可腾的返回false
+bool heapPlanCompaction();
+
+// 整理第二步：把腾空页上的对象搬进同一slab的其他页，旧槽里留下新地址
+void heapEvacuate();
+
+// 整理第三步：修引用。对象被搬走了就返回新地址
+static inline Obj* heapForward(Obj* object)
+{
+    if (object == NULL || !pageOf(object)->evacuating) return object;
+    return *(Obj**)object;
+}
+
+// 定长附属内存在腾空页上就搬一份，返回新地址（只能对不超过HEAP_SMALL_MAX的内存调用）
+void* heapRelocateFixed(void* pointer);
+
+// 遍历堆上所有对象（腾空页除外）
+void heapForEachObject(void (*visit)(Obj*));
+
+// 整理最后一步：腾空的页还给系统
+void heapFinishCompaction();
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef clox_heapdump_h
+#define clox_heapdump_h
+
+#include <signal.h>
+
+#include "common.h"
+
+// 堆快照：从markRoots的那些根出发按blackenObject的边广度优先走一遍，
+// 每个可达对象写一行类型、自身字节数、第一次走到它的父对象和边（串起来就是最短的根路径），
+// 后面跟着它的出边；tools/heapsnap.c读这个文件算支配树和保留大小
+//   lox-heap-snapshot 1
+//   R <id> <根>                     根引用的对象
+//   O <id> <类型> <字节> <父id> <边> [摘要]    父id为0表示直接挂在根上
+//   E <id> <边>                     上一个O的出边
+
+#define HEAP_DUMP_SIGNAL        SIGUSR1
+
+// 收到信号还没写快照，信号处理函数置位，安全点检查
+extern volatile sig_atomic_t heapDumpPending;
+
+// 解析--heap-dump=PATH：收到SIGUSR1时在下一个安全点写快照，第n次写到PATH.n，不认识返回false
+bool heapDumpOption(const char* arg);
+
+// 把快照写到path，返回写了多少个对象，打不开文件返回-1
+// 只读不分配对象，只能在对象不会搬家的地方调：安全点、本地函数里
+int dumpHeap(const char* path);
+
+// 安全点上处理收到的信号
+void heapDumpDrain();
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef clox_image_h
+#define clox_image_h
+
+#include "common.h"
+
+// 堆镜像：--save-image=PATH时脚本跑完把全局变量能走到的所有对象（字符串、函数、闭包、上值、
+// 类、实例、绑定方法、本地函数）写成镜像文件，对象之间的引用换成编号；
+// --image=PATH时新进程启动先读镜像：按编号把对象重新分配出来，再把编号换回指针，
+// 字符串重新驻留，全局变量装回去，然后直接执行脚本或者进REPL，不用再跑一遍初始化。
+// 对象堆是按页、按尺寸分档管理的，镜像没法原样映射进来，只能逐个重新分配
+//   头 | 对象（按类型排好，构造时要用的对象总在前面）| 全局变量
+// 对象里的值：0 nil 1 false 2 true 3 数（8字节）4 对象（编号）
+
+#define IMAGE_MAGIC             "LOXIMG1"
+#define IMAGE_VERSION           1       // 改了格式或者对象布局就加一
+
+#define IMAGE_NIL               0
+#define IMAGE_FALSE             1
+#define IMAGE_TRUE              2
+#define IMAGE_NUMBER            3
+#define IMAGE_OBJECT            4
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t objectCount;
+    uint64_t payloadSize;
+    uint64_t payloadHash;
+} ImageHeader;
+
+typedef struct
+{
+    const char* loadPath;
+    const char* savePath;
+} Image;
+
+extern Image image;
+
+// 解析--image=PATH、--save-image=PATH，不认识返回false
+bool imageOption(const char* arg);
+
+// 把堆写成镜像，成功返回写了多少个对象，失败返回-1；只能在脚本跑完、没有栈帧的时候调
+int saveImage(const char* path);
+
+// 读镜像，装进刚初始化的虚拟机；文件打不开、内容不对返回false
+bool loadImage(const char* path);
+
+// 读镜像期间已经建好的对象还没挂到全局变量上，GC时当根标记
+void markImageRoots();
+
+#endif
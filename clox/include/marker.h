@@ -0,0 +1,20 @@
+#ifndef clox_marker_h
+#define clox_marker_h
+
+#include "common.h"
+#include "object.h"
+
+#ifdef GC_PARALLEL_MARK
+
+// 把刚标记的对象压入当前线程自己的灰色双端队列
+void pushGray(Obj* object);
+
+// 多个线程一起清空灰色队列，没活干的线程去别人的队列里偷
+void parallelTrace(void (*blacken)(Obj*));
+
+// 回收标记线程
+void freeMarkers();
+
+#endif
+
+#endif
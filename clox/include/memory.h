@@ -3,12 +3,13 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
-// 申请一个对象
-#define ALLOCATE(type, count) (type*)reallocate(NULL, 0, sizeof(type) * (count))
+// 申请定长内存（字符串的字符、闭包的上值数组），小块走按尺寸分档的slab
+#define ALLOCATE(type, count) (type*)reallocateFixed(NULL, 0, sizeof(type) * (count))
 
-// 释放一个对象
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+// 释放ALLOCATE申请的内存
+#define FREE(type, pointer, count) reallocateFixed(pointer, sizeof(type) * (count), 0)
 
 // 动态数组扩容
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) * 2)
@@ -19,9 +20,19 @@
 #define FREE_APPLY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
-// 分配内存实现函数，所有内存操作都经过此函数
+// 分配内存实现函数，动态数组的内存操作都经过此函数
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
 
+// 定长内存的分配与释放，同样记账、触发GC
+void* reallocateFixed(void* pointer, size_t oldSize, size_t newSize);
+
+// 确认接下来还能申请size字节：该GC就GC，超过上限就报内存不足
+// 几块内存要连着申请、中间失败会泄漏前面的那块时，先整体预留一下
+void reserveMemory(size_t size);
+
+// 从对象堆里为一个对象分配内存
+Obj* allocateObjectMemory(size_t size, ObjType type);
+
 void markObject(Obj* Object);
 
 // 标记一个变量
@@ -33,4 +44,32 @@ void collectGarbage();
 // 释放堆上为对象申请的内存
 void freeObjects();
 
+// 整理堆：把稀疏页上的对象搬走并修好所有引用，腾空的页还给系统
+// 对象会换地址，只能在C代码没有拿着对象指针的安全点调用（解释器循环的回跳、返回，本地函数里）
+void compactHeap();
+
+#ifdef GC_CONCURRENT
+
+// 堆锁：标记线程每次染黑对象时持有，修改对象内部引用时也要持有
+void lockHeap();
+void unlockHeap();
+
+// 并发标记时新出现的字符串驻留命中，要在快照里补上
+#define SHADE_OBJECT(object) \
+    do { if (vm.marking) { lockHeap(); markObject((Obj*)(object)); unlockHeap(); } } while (false)
+
+// SATB写屏障：标记期间覆盖堆中的引用前先把旧值标灰，保证快照时可达的对象都能被标记
+#define BARRIER_BEGIN()         bool barrierHeld = vm.marking; if (barrierHeld) lockHeap()
+#define BARRIER_SHADE(value)    if (barrierHeld) markValue(value)
+#define BARRIER_END()           if (barrierHeld) unlockHeap()
+
+#else
+
+#define SHADE_OBJECT(object)
+#define BARRIER_BEGIN()
+#define BARRIER_SHADE(value)
+#define BARRIER_END()
+
+#endif
+
 #endif
\ No newline at end of file
@@ -9,14 +9,38 @@
 // 获取对象类型具体是哪个：字符串、实例、函数...
 #define OBJ_TYPE(value)             (AS_OBJ(value)->type)
 
+#ifdef NAN_BOXING
+
+// 最常判断的三种对象把类型编进值里，判断只看寄存器，其他类型照旧读对象头
+#define OBJ_TAG_STRING              ((uint64_t)1 << 48)
+#define OBJ_TAG_INSTANCE            ((uint64_t)2 << 48)
+#define OBJ_TAG_CLOSURE             ((uint64_t)3 << 48)
+#define HAS_OBJ_TAG(value, tag)     (((value) & (SIGN_BIT | QUAN | OBJ_TAG_MASK)) == (SIGN_BIT | QUAN | (tag)))
+
+// 指针类型已经说明了是什么对象就直接打标签，否则读对象头
+#define OBJ_VAL(obj) _Generic((obj), \
+    ObjString*: TAGGED_OBJ_VAL(obj, OBJ_TAG_STRING), \
+    ObjInstance*: TAGGED_OBJ_VAL(obj, OBJ_TAG_INSTANCE), \
+    ObjClosure*: TAGGED_OBJ_VAL(obj, OBJ_TAG_CLOSURE), \
+    default: objToValue((Obj*)(obj)))
+
 // 判断
-#define IS_BOUND_METHOD(value)      isObjType(value, OBJ_BOUND_METHOD)
+#define IS_INSTANCE(value)          HAS_OBJ_TAG(value, OBJ_TAG_INSTANCE)
+#define IS_CLOSURE(value)           HAS_OBJ_TAG(value, OBJ_TAG_CLOSURE)
+#define IS_STRING(value)            HAS_OBJ_TAG(value, OBJ_TAG_STRING)
+
+#else
+
 #define IS_INSTANCE(value)          isObjType(value, OBJ_INSTANCE)
-#define IS_CLASS(value)             isObjType(value, OBJ_CLASS)
 #define IS_CLOSURE(value)           isObjType(value, OBJ_CLOSURE)
+#define IS_STRING(value)            isObjType(value, OBJ_STRING)
+
+#endif
+
+#define IS_BOUND_METHOD(value)      isObjType(value, OBJ_BOUND_METHOD)
+#define IS_CLASS(value)             isObjType(value, OBJ_CLASS)
 #define IS_FUNCTION(value)          isObjType(value, OBJ_FUNCTION)
 #define IS_NATIVE(value)            isObjType(value, OBJ_NATIVE)
-#define IS_STRING(value)            isObjType(value, OBJ_STRING)
 
 // 转换
 #define AS_BOUND_METHOD(value)      ((ObjBoundMethod*)AS_OBJ(value))
@@ -41,12 +65,10 @@ typedef enum
     OBJ_UPVALUE,
 } ObjType;
 
-// 各个类型的实现
+// 各个类型的实现，标记位在对象所在页的位图里（heap.h）
 struct Obj
 {
     ObjType type;
-    bool isMarked;      // 标记
-    struct Obj* next;   // 用于GC
 };
 
 // 上值的运行时表示，将闭包在栈上剔除掉值保存在堆中
@@ -58,6 +80,16 @@ typedef struct ObjUpvalue
     struct ObjUpvalue* next;
 } ObjUpvalue;
 
+#ifdef GC_COMPRESSED_REFS
+typedef ObjRef UpvalueRef;  // 上值数组里存压缩引用
+#define UPVALUE_REF(upvalue)        compressRef((Obj*)(upvalue))
+#define UPVALUE_AT(closure, i)      ((ObjUpvalue*)expandRef((closure)->upvalues[i]))
+#else
+typedef ObjUpvalue* UpvalueRef;
+#define UPVALUE_REF(upvalue)        ((ObjUpvalue*)(upvalue))
+#define UPVALUE_AT(closure, i)      ((closure)->upvalues[i])
+#endif
+
 struct ObjString    
 {
     Obj obj;            // 实现多态
@@ -71,6 +103,7 @@ typedef struct
     Obj obj;            // 多态
     int arity;          // 参数数量
     int upvalueCount;   // 上值数
+    uint32_t id;        // 飞行记录器里的编号，没登记是0
     Chunk chunk;        // 字节码
     ObjString* name;    // 函数名
 } ObjFunction;
@@ -79,7 +112,7 @@ typedef struct          // 将独立的函数作用域串起来
 {
     Obj obj;
     ObjFunction* function;
-    ObjUpvalue** upvalues;  // 每个函数都要拖着自己的上值前行emmm
+    UpvalueRef* upvalues;   // 每个函数都要拖着自己的上值前行emmm
     int upvalueCount;
 } ObjClosure;
 
@@ -133,6 +166,9 @@ ObjFunction* newFunction();
 // 为本地函数开辟内存
 ObjNative* newNative(NativeFn function);
 
+// 为一个长length的字符串预留字符和对象的内存，之后两次申请都不会因为堆上限失败
+void reserveString(int length);
+
 // 将代码中的c字符串转换成ObjString-不分配内存版
 ObjString* takeString(char* chars, int length);
 
@@ -151,4 +187,22 @@ static inline bool isObjType(Value value, ObjType type)
     return IS_OBJ(value) && OBJ_TYPE(value) == type;
 }
 
+#ifdef NAN_BOXING
+
+// 类型不确定的对象装箱，读一次对象头决定标签
+static inline Value objToValue(Obj* object)
+{
+    uint64_t tag = 0;
+    switch (object->type)
+    {
+        case OBJ_STRING:    tag = OBJ_TAG_STRING; break;
+        case OBJ_INSTANCE:  tag = OBJ_TAG_INSTANCE; break;
+        case OBJ_CLOSURE:   tag = OBJ_TAG_CLOSURE; break;
+        default:            break;
+    }
+    return TAGGED_OBJ_VAL(object, tag);
+}
+
+#endif
+
 #endif
\ No newline at end of file
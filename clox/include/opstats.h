@@ -0,0 +1,74 @@
+#ifndef clox_opstats_h
+#define clox_opstats_h
+
+#include "chunk.h"
+#include "object.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+// 指令统计：--opcode-stats时解释器换成带计数的那份循环，统计每种指令执行了多少次，
+// 顺带记下OP_INVOKE、OP_GET_PROPERTY各个调用点的次数；--opcode-cycles再给每种指令累计时钟周期
+// 退出时按次数排好序打印到stderr
+
+#define OPSTATS_TOP_SITES       10      // 每种指令打印多少个最热的调用点
+
+typedef struct
+{
+    bool enabled;
+    bool cycles;
+    uint64_t counts[OPCODE_COUNT];
+    uint64_t cycleCounts[OPCODE_COUNT];
+    uint64_t lastTime;          // 上一条指令开始的时间
+    int lastOpcode;             // 上一条指令，-1表示还没开始
+} OpStats;
+
+extern OpStats opstats;
+
+// 解析--opcode-stats、--opcode-cycles，不认识返回false
+bool opstatsOption(const char* arg);
+
+// 记一次调用点
+void opstatsSite(ObjFunction* function, uint8_t* ip);
+
+// 函数要释放了：它的调用点留到报告里，指令地址不再认
+void opstatsRelease(ObjFunction* function);
+
+static inline uint64_t opstatsNow()
+{
+    #if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+    #else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    #endif
+}
+
+// 每条指令执行前调，上一条指令的周期数这时候才知道
+static inline void opstatsInstruction(ObjFunction* function, uint8_t* ip)
+{
+    uint64_t start = opstats.cycles ? opstatsNow() : 0;
+
+    uint8_t opcode = *ip;
+    opstats.counts[opcode]++;
+    if (opcode == OP_INVOKE || opcode == OP_GET_PROPERTY) opstatsSite(function, ip);
+
+    if (opstats.cycles)
+    {
+        if (opstats.lastOpcode >= 0) opstats.cycleCounts[opstats.lastOpcode] += start - opstats.lastTime;
+        opstats.lastOpcode = opcode;
+        opstats.lastTime = opstatsNow();    // 统计自己花的时间不算进指令里
+    }
+}
+
+// run()返回时调，最后一条指令的周期数就不算了
+static inline void opstatsPause()
+{
+    opstats.lastOpcode = -1;
+}
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef clox_probes_h
+#define clox_probes_h
+
+#include "common.h"
+
+// 静态探针：和systemtap的sys/sdt.h一样，在探针处放一条nop，把地址和参数所在的位置
+// 写进ELF的.note.stapsdt段，不依赖任何外部头文件；没人挂的时候只是一条nop，
+// 参数本来就在寄存器或栈上，编译器不用额外算。perf、bpftrace直接认，不用重新编译：
+//   perf probe -x clox sdt_lox:function__entry
+//   bpftrace -e 'usdt:./clox:lox:gc__start { @s = nsecs } usdt:./clox:lox:gc__done { @ns = hist(nsecs - @s) }'
+//
+// 探针                     参数
+//   function__entry        函数名（脚本顶层为NULL）、调用深度
+//   function__return       函数名、调用深度
+//   gc__start              GC前的堆字节数
+//   gc__done               GC后的堆字节数
+//   string__intern         字符、长度（只有新建的字符串，命中驻留表的不算）
+//   instance__new          类名
+//
+// 参数一律按64位有符号整数传，字符串传指针。common.h里定义NO_PROBES可以全部去掉
+
+#if !defined(NO_PROBES) && defined(__linux__) && defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+
+// 所有探针地址相对这个符号计算，prelink、加载基址变了工具也能找到
+#define PROBE_BASE  \
+    ".ifndef _.stapsdt.base\n"  \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n"    \
+    ".hidden _.stapsdt.base\n"  \
+    "_.stapsdt.base: .space 1\n"    \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n"
+
+// 一条note：nop的地址、基址、信号量（不用，填0）、提供者、探针名、参数描述
+#define PROBE_NOTE(name, args)  \
+    "990: nop\n"    \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"   \
+    ".balign 4\n"   \
+    ".4byte 992f-991f, 994f-993f, 3\n"  \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n"  \
+    "993: .8byte 990b\n"    \
+    ".8byte _.stapsdt.base\n"   \
+    ".8byte 0\n"    \
+    ".asciz \"lox\"\n"  \
+    ".asciz \"" #name "\"\n"    \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n"  \
+    ".popsection\n" \
+    PROBE_BASE
+
+// 参数约束nor：立即数、内存、寄存器都行，编译器挑现成的位置
+#define PROBE_ARG(value)    "nor"((int64_t)(value))
+
+#define PROBE0(name) \
+    __asm__ __volatile__(PROBE_NOTE(name, ""))
+#define PROBE1(name, a) \
+    __asm__ __volatile__(PROBE_NOTE(name, "-8@%0") :: PROBE_ARG(a))
+#define PROBE2(name, a, b) \
+    __asm__ __volatile__(PROBE_NOTE(name, "-8@%0 -8@%1") :: PROBE_ARG(a), PROBE_ARG(b))
+#define PROBE3(name, a, b, c) \
+    __asm__ __volatile__(PROBE_NOTE(name, "-8@%0 -8@%1 -8@%2") :: PROBE_ARG(a), PROBE_ARG(b), PROBE_ARG(c))
+
+#else
+
+#define PROBE0(name)
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+
+#endif
+
+// 函数名给探针用，顶层脚本没有名字
+#define PROBE_FUNCTION_NAME(function) \
+    ((function)->name != NULL ? (intptr_t)(function)->name->chars : (intptr_t)0)
+
+#endif
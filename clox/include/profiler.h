@@ -0,0 +1,37 @@
+#ifndef clox_profiler_h
+#define clox_profiler_h
+
+#include <signal.h>
+
+#include "common.h"
+
+// 采样分析器：SIGPROF定时打断解释器，信号处理函数只把vm.frames里的函数指针和偏移抄进环形缓冲区，
+// 到了安全点再解析成函数名和行号，按调用栈累计，退出时写成火焰图工具认的折叠栈格式
+//   <script>:12;outer:3;fib:2 57
+
+#define PROFILE_HZ_DEFAULT      1000
+#define PROFILE_BUFFER          64      // 环形缓冲区能攒的样本数，安全点来得太晚多出来的丢掉
+
+// 虚拟机当前在干什么，采样时一起记下；整理堆时栈帧不可信，只记一个[compact]
+#define PROFILE_MUTATOR         0
+#define PROFILE_COMPILE         1
+#define PROFILE_GC              2
+#define PROFILE_COMPACT         3
+
+// 有没攒下的样本，信号处理函数置位，安全点检查
+extern volatile sig_atomic_t profilePending;
+extern volatile sig_atomic_t profileState;
+
+// 解析--profile=PATH、--profile-hz=N，不认识返回false
+bool profilerOption(const char* arg);
+
+// 按命令行参数开始采样，没给--profile什么都不做
+void startProfiler();
+
+// 把攒下的样本解析掉，只能在对象不会被释放、搬家的地方调：安全点、run()返回后
+void profilerDrain();
+
+// 停止采样，写出结果
+void stopProfiler();
+
+#endif
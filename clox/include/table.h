@@ -4,13 +4,38 @@
 #include "common.h"
 #include "value.h"
 
+#ifdef GC_COMPRESSED_REFS
+
+// 键存成32位压缩引用，值紧跟着不补齐，一项12字节
+typedef ObjRef EntryKey;
+
+typedef struct __attribute__((packed, aligned(4)))
+{
+    EntryKey key;
+    Value value;
+} Entry;
+
+#define KEY_REF(string)         compressRef((Obj*)(string))
+#define KEY_STRING(key)         ((ObjString*)expandRef(key))
+#define NO_KEY                  0
+
+#else
+
+typedef ObjString* EntryKey;
+
 // 存储的key-value
 typedef struct
 {
-    ObjString* key;
+    EntryKey key;
     Value value;
 } Entry;
 
+#define KEY_REF(string)         ((ObjString*)(string))
+#define KEY_STRING(key)         (key)
+#define NO_KEY                  NULL
+
+#endif
+
 // hash表-动态数组
 typedef struct
 {
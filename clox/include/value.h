@@ -1,6 +1,7 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include <math.h>
 #include <string.h>
 
 #include "common.h"
@@ -9,6 +10,25 @@
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef GC_COMPRESSED_REFS
+
+// 压缩引用：相对堆基址的偏移，以16字节为单位，保留区的第一页不分配，0就是NULL
+typedef uint32_t ObjRef;
+
+extern char* heapBase;
+
+static inline ObjRef compressRef(Obj* object)
+{
+    return object == NULL ? 0 : (ObjRef)(((char*)object - heapBase) >> 4);
+}
+
+static inline Obj* expandRef(ObjRef ref)
+{
+    return ref == 0 ? NULL : (Obj*)(heapBase + ((size_t)ref << 4));
+}
+
+#endif
+
 #ifdef NAN_BOXING
 
 #define QUAN                    ((uint64_t)0x7ffc000000000000)
@@ -17,24 +37,38 @@ typedef struct ObjString ObjString;
 #define TAG_NIL                 1
 #define TAG_FALSE               2
 #define TAG_TRUE                3
+#define TAG_INT                 ((uint64_t)1 << 49)     // 小整数：QUAN | TAG_INT，低32位是int32
+#define INT_MASK                (SIGN_BIT | QUAN | TAG_INT)
+#define OBJ_TAG_MASK            ((uint64_t)3 << 48)     // 对象值的48、49位：常用对象的类型标签（object.h）
 
 typedef uint64_t Value;
 
+#ifdef SMALL_INT
+// 数字有两种编码：double和int32，对Lox来说是同一种类型，整数只是个快速通道
+#define IS_DOUBLE(value)        (((value) & QUAN) != QUAN)
+#define IS_INT(value)           (((value) & INT_MASK) == (QUAN | TAG_INT))
+#define IS_NUMBER(value)        (IS_DOUBLE(value) || IS_INT(value))
+#else
+#define IS_INT(value)           false
 #define IS_NUMBER(value)        (((value) & QUAN) != QUAN)
+#endif
 #define IS_NIL(value)           ((value) == NIL_VAL)
 #define IS_BOOL(value)          (((value) | 1) == TRUE_VAL)
 #define IS_OBJ(value)           (((value) & (QUAN | SIGN_BIT)) == (QUAN | SIGN_BIT))
 
 #define AS_NUMBER(value)        valueToNum(value)
+#define AS_INT(value)           ((int32_t)(uint32_t)(value))
 #define AS_BOOL(value)          ((value) == TRUE_VAL)
-#define AS_OBJ(value)           ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QUAN)))
+#define AS_OBJ(value)           ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QUAN | OBJ_TAG_MASK)))
 
 #define NUMBER_VAL(num)         numToValue(num)
+#define INT_VAL(i)              ((Value)(QUAN | TAG_INT | (uint32_t)(int32_t)(i)))
 #define NIL_VAL                 ((Value)(uint64_t)(QUAN | TAG_NIL))
 #define FALSE_VAL               ((Value)(uint64_t)(QUAN | TAG_FALSE))
 #define TRUE_VAL                ((Value)(uint64_t)(QUAN | TAG_TRUE))
 #define BOOL_VAL(b)             ((b) ? TRUE_VAL : FALSE_VAL)
-#define OBJ_VAL(obj)            (Value)(SIGN_BIT | QUAN | (uint64_t)(uintptr_t)(obj))
+#define TAGGED_OBJ_VAL(obj, tag) (Value)(SIGN_BIT | QUAN | (tag) | (uint64_t)(uintptr_t)(obj))
+// OBJ_VAL要按对象类型打标签，在object.h里
 
 static inline Value numToValue(double num)
 {
@@ -45,11 +79,25 @@ static inline Value numToValue(double num)
 
 static inline double valueToNum(Value value)
 {
+    if (IS_INT(value)) return AS_INT(value);
+
     double num;
     memcpy(&num, &value, sizeof(Value));
     return num;
 }
 
+// 能用小整数表示就用小整数，-0只能是double
+static inline Value compactNumber(double num)
+{
+    #ifdef SMALL_INT
+    if (num >= INT32_MIN && num <= INT32_MAX && num == (int32_t)num && !(num == 0 && signbit(num)))
+    {
+        return INT_VAL((int32_t)num);
+    }
+    #endif
+    return numToValue(num);
+}
+
 #else
 
 // 值的类型
@@ -90,6 +138,12 @@ typedef struct
 #define NUMBER_VAL(value)       ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)         ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
+// 联合体表示没有小整数编码，整数快速通道直接关掉
+#define IS_INT(value)           false
+#define AS_INT(value)           ((int32_t)AS_NUMBER(value))
+#define INT_VAL(i)              NUMBER_VAL((double)(i))
+#define compactNumber(num)      NUMBER_VAL(num)
+
 #endif
 
 // 常量池，动态数组
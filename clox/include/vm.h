@@ -1,6 +1,8 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <setjmp.h>
+
 #include "object.h"
 #include "value.h"
 #include "table.h"
@@ -28,7 +30,6 @@ typedef struct
     Table strings;                  // hash表中驻留的字符串-集合
     ObjString* initString;          // 初始化类的名称
     ObjUpvalue* openUpvalues;       // 指向上值的堆地址的指针列表头
-    Obj* objects;                   // 指向申请内存的对象
 
     int grayCount;                  // 三色抽象灰色工厂
     int grayCapacity;
@@ -36,6 +37,12 @@ typedef struct
 
     size_t bytesAllocated;          // GC触发机制
     size_t nextGC;
+    bool compactPending;            // 碎片太多，下一个安全点整理堆
+    jmp_buf* errorJump;             // 内存不足时跳回interpret，不在interpret里时为NULL
+
+#ifdef GC_CONCURRENT
+    bool marking;                   // 并发标记周期进行中，新对象直接染黑
+#endif
 } VM;
 
 // 虚拟机执行过程结果
@@ -56,6 +63,12 @@ void freeVM();
 // 开始执行吧，宝贝（呕）
 InterpretResult interpret(const char* source);
 
+// 内存不足：报运行时错误，丢掉当前的执行跳回interpret
+void outOfMemory();
+
+// 本地函数的名字，不是内置的返回NULL
+const char* nativeName(NativeFn function);
+
 // 入栈、出栈
 void push(Value value);
 Value pop();
@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocprof.h"
+#include "gc.h"
+#include "heap.h"
+#include "vm.h"
+
+#define ALLOC_TOP_SITES         50      // 报告里按字节数列出的调用点个数
+#define TOMBSTONE               ((Obj*)1)
+
+// 分配点：同一函数同一行分配的同一类对象
+typedef struct
+{
+    uint8_t* code;              // 函数的字节码数组，查表用，不跟着对象搬家；NULL表示不在Lox代码里
+    int line;
+    ObjType type;
+    char* description;          // 第一次遇到时生成：函数名:行号
+    bool released;              // 函数已经释放，字节码的地址会给别的函数用，不再查到它
+
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t freed;
+    uint64_t survived;          // 活过至少一次GC的个数
+    uint64_t young;             // 上一次GC之后分配的
+    uint64_t youngFreed;        // 其中在这一轮就被清掉的
+} Site;
+
+// 每个活着的对象是哪儿分配的
+typedef struct
+{
+    Obj* object;
+    int site;
+    uint32_t epoch;             // 分配时已经完成的GC轮数
+} Tracked;
+
+AllocProfile allocProfile;
+
+static Site* sites = NULL;
+static int siteCount = 0;
+static int siteCapacity = 0;
+static int* siteIndex = NULL;   // 开放寻址，存sites的下标+1
+static int siteIndexCapacity = 0;
+
+static Tracked* objects = NULL;
+static int objectCount = 0;     // 含墓碑
+static int objectCapacity = 0;
+
+static uint32_t epoch = 0;
+static int lastSite = -1;       // 最近一次分配的调用点
+
+static void* allocate(size_t size)
+{
+    void* result = calloc(1, size);
+    if (result == NULL)
+    {
+        fprintf(stderr, "Not enough memory for the allocation profiler.\n");
+        exit(1);
+    }
+    return result;
+}
+
+bool allocProfileOption(const char* arg)
+{
+    if (strncmp(arg, "--alloc-profile=", 16) != 0 || arg[16] == '\0') return false;
+
+    if (!allocProfile.enabled) atexit(allocProfileReport);
+    allocProfile.enabled = true;
+    allocProfile.path = arg + 16;
+    return true;
+}
+
+static uint32_t hashPointer(const void* pointer)
+{
+    uint64_t bits = (uint64_t)(uintptr_t)pointer;
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+static uint32_t hashSite(uint8_t* code, int line, ObjType type)
+{
+    return hashPointer(code) ^ ((uint32_t)line * 2654435761u) ^ ((uint32_t)type * 40503u);
+}
+
+static void rebuildSiteIndex(int capacity)
+{
+    free(siteIndex);
+    siteIndexCapacity = capacity;
+    siteIndex = allocate(sizeof(int) * siteIndexCapacity);
+
+    for (int i = 0; i < siteCount; ++i)
+    {
+        if (sites[i].released) continue;
+        uint32_t index = hashSite(sites[i].code, sites[i].line, sites[i].type) & (siteIndexCapacity - 1);
+        while (siteIndex[index] != 0) index = (index + 1) & (siteIndexCapacity - 1);
+        siteIndex[index] = i + 1;
+    }
+}
+
+// 当前栈帧的分配点，没有就新建
+static int currentSite(ObjType type)
+{
+    uint8_t* code = NULL;
+    int line = 0;
+    ObjFunction* function = NULL;
+    if (vm.frameCount > 0)
+    {
+        CallFrame* frame = &vm.frames[vm.frameCount - 1];
+        function = frame->closure->function;
+        code = function->chunk.code;
+        int offset = (int)(frame->ip - code) - 1;
+        line = getLine(&function->chunk, offset < 0 ? 0 : offset);
+    }
+
+    if (siteIndexCapacity > 0)
+    {
+        uint32_t index = hashSite(code, line, type) & (siteIndexCapacity - 1);
+        while (siteIndex[index] != 0)
+        {
+            Site* site = &sites[siteIndex[index] - 1];
+            if (site->code == code && site->line == line && site->type == type) return siteIndex[index] - 1;
+            index = (index + 1) & (siteIndexCapacity - 1);
+        }
+    }
+
+    if (siteCount + 1 > siteCapacity)
+    {
+        siteCapacity = siteCapacity < 64 ? 64 : siteCapacity * 2;
+        sites = realloc(sites, sizeof(Site) * siteCapacity);
+        if (sites == NULL)
+        {
+            fprintf(stderr, "Not enough memory for the allocation profiler.\n");
+            exit(1);
+        }
+    }
+    if ((siteCount + 1) * 4 > siteIndexCapacity * 3) rebuildSiteIndex(siteIndexCapacity < 64 ? 64 : siteIndexCapacity * 2);
+
+    Site* site = &sites[siteCount];
+    memset(site, 0, sizeof(Site));
+    site->code = code;
+    site->line = line;
+    site->type = type;
+
+    char buffer[256];
+    if (function == NULL)
+    {
+        snprintf(buffer, sizeof(buffer), "[vm]");   // 编译器、虚拟机初始化、本地函数表
+    }
+    else
+    {
+        snprintf(buffer, sizeof(buffer), "%s:%d", function->name != NULL ? function->name->chars : "<script>", line);
+    }
+    site->description = strdup(buffer);
+
+    uint32_t index = hashSite(code, line, type) & (siteIndexCapacity - 1);
+    while (siteIndex[index] != 0) index = (index + 1) & (siteIndexCapacity - 1);
+    siteIndex[index] = siteCount + 1;
+    return siteCount++;
+}
+
+static void insertObject(Tracked tracked)
+{
+    uint32_t index = hashPointer(tracked.object) & (objectCapacity - 1);
+    while (objects[index].object != NULL) index = (index + 1) & (objectCapacity - 1);
+    objects[index] = tracked;
+    objectCount++;
+}
+
+// 扩容或者按新地址重建，墓碑顺便清掉
+static void rebuildObjects(int capacity, bool forward)
+{
+    Tracked* old = objects;
+    int oldCapacity = objectCapacity;
+
+    objects = allocate(sizeof(Tracked) * capacity);
+    objectCapacity = capacity;
+    objectCount = 0;
+
+    for (int i = 0; i < oldCapacity; ++i)
+    {
+        if (old[i].object == NULL || old[i].object == TOMBSTONE) continue;
+        Tracked tracked = old[i];
+        if (forward) tracked.object = heapForward(tracked.object);
+        insertObject(tracked);
+    }
+    free(old);
+}
+
+void allocProfileObject(Obj* object, size_t size)
+{
+    int index = currentSite(object->type);
+    Site* site = &sites[index];
+    site->count++;
+    site->bytes += heapSlotSize(size);
+    site->young++;
+    lastSite = index;
+
+    if ((objectCount + 1) * 4 > objectCapacity * 3)
+    {
+        rebuildObjects(objectCapacity < 1024 ? 1024 : objectCapacity * 2, false);
+    }
+    insertObject((Tracked){ object, index, epoch });
+}
+
+void allocProfileOwned(size_t size)
+{
+    if (lastSite >= 0) sites[lastSite].bytes += heapSlotSize(size);
+}
+
+void allocProfileFree(Obj* object)
+{
+    if (objectCapacity == 0) return;
+
+    uint32_t index = hashPointer(object) & (objectCapacity - 1);
+    while (objects[index].object != NULL)
+    {
+        if (objects[index].object == object)
+        {
+            Site* site = &sites[objects[index].site];
+            site->freed++;
+            if (objects[index].epoch == epoch) site->youngFreed++;
+            objects[index].object = TOMBSTONE;
+            return;
+        }
+        index = (index + 1) & (objectCapacity - 1);
+    }
+}
+
+void allocProfileRelease(ObjFunction* function)
+{
+    uint8_t* code = function->chunk.code;
+    if (code == NULL) return;
+
+    bool found = false;
+    for (int i = 0; i < siteCount; ++i)
+    {
+        if (sites[i].code != code || sites[i].released) continue;
+        sites[i].released = true;
+        found = true;
+    }
+    if (found) rebuildSiteIndex(siteIndexCapacity);
+}
+
+void allocProfileCollected()
+{
+    for (int i = 0; i < siteCount; ++i)
+    {
+        sites[i].survived += sites[i].young - sites[i].youngFreed;
+        sites[i].young = 0;
+        sites[i].youngFreed = 0;
+    }
+    epoch++;
+}
+
+void allocProfileRelocate()
+{
+    if (objectCapacity > 0) rebuildObjects(objectCapacity, true);
+}
+
+static const char* typeName(ObjType type)
+{
+    switch (type)
+    {
+        case OBJ_BOUND_METHOD: return "bound_method";
+        case OBJ_NATIVE: return "native";
+        case OBJ_INSTANCE: return "instance";
+        case OBJ_CLASS: return "class";
+        case OBJ_FUNCTION: return "function";
+        case OBJ_CLOSURE: return "closure";
+        case OBJ_STRING: return "string";
+        case OBJ_UPVALUE: return "upvalue";
+    }
+    return "?";
+}
+
+static int compareBytes(const void* a, const void* b)
+{
+    const Site* x = &sites[*(const int*)a];
+    const Site* y = &sites[*(const int*)b];
+    if (x->bytes != y->bytes) return (y->bytes > x->bytes) - (y->bytes < x->bytes);
+    return (y->count > x->count) - (y->count < x->count);
+}
+
+static void writeRow(FILE* file, const char* name, uint64_t count, uint64_t bytes, uint64_t survived, uint64_t live)
+{
+    fprintf(file, "%-14s %12llu %14llu %12llu %6.1f%% %10llu", name, (unsigned long long)count,
+        (unsigned long long)bytes, (unsigned long long)survived, count > 0 ? 100.0 * survived / count : 0,
+        (unsigned long long)live);
+}
+
+static void writeReport(FILE* file)
+{
+    uint64_t typeCount[GC_OBJ_TYPES] = { 0 };
+    uint64_t typeBytes[GC_OBJ_TYPES] = { 0 };
+    uint64_t typeSurvived[GC_OBJ_TYPES] = { 0 };
+    uint64_t typeLive[GC_OBJ_TYPES] = { 0 };
+    for (int i = 0; i < siteCount; ++i)
+    {
+        Site* site = &sites[i];
+        typeCount[site->type] += site->count;
+        typeBytes[site->type] += site->bytes;
+        typeSurvived[site->type] += site->survived;
+        typeLive[site->type] += site->count - site->freed;
+    }
+
+    fprintf(file, "Collections: %u\n\n", epoch);
+    fprintf(file, "%-14s %12s %14s %12s %7s %10s\n", "type", "objects", "bytes", "survived_gc", "%", "live");
+    for (int type = 0; type < GC_OBJ_TYPES; ++type)
+    {
+        if (typeCount[type] == 0) continue;
+        writeRow(file, typeName(type), typeCount[type], typeBytes[type], typeSurvived[type], typeLive[type]);
+        fprintf(file, "\n");
+    }
+
+    int* order = allocate(sizeof(int) * (siteCount > 0 ? siteCount : 1));
+    for (int i = 0; i < siteCount; ++i) order[i] = i;
+    qsort(order, siteCount, sizeof(int), compareBytes);
+
+    fprintf(file, "\nTop sites by bytes:\n%-14s %12s %14s %12s %7s %10s  site\n", "type", "objects", "bytes",
+        "survived_gc", "%", "live");
+    for (int i = 0; i < siteCount && i < ALLOC_TOP_SITES; ++i)
+    {
+        Site* site = &sites[order[i]];
+        writeRow(file, typeName(site->type), site->count, site->bytes, site->survived, site->count - site->freed);
+        fprintf(file, "  %s\n", site->description);
+    }
+    free(order);
+}
+
+void allocProfileReport()
+{
+    if (!allocProfile.enabled) return;
+    allocProfile.enabled = false;   // 虚拟机退出时整页释放的对象不算
+
+    FILE* file = fopen(allocProfile.path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not open allocation profile \"%s\".\n", allocProfile.path);
+    }
+    else
+    {
+        writeReport(file);
+        fclose(file);
+    }
+
+    for (int i = 0; i < siteCount; ++i)
+    {
+        free(sites[i].description);
+    }
+    free(sites);
+    free(siteIndex);
+    free(objects);
+    sites = NULL;
+    siteIndex = NULL;
+    objects = NULL;
+    siteCount = siteCapacity = siteIndexCapacity = 0;
+    lastSite = -1;
+    objectCount = objectCapacity = 0;
+}
@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bytecache.h"
+#include "compiler.h"
+#include "debug.h"
+#include "flight.h"
+#include "memory.h"
+#include "vm.h"
+
+#define NESTING_MAX             256     // 函数嵌套最多几层，防止坏文件把C栈递归爆
+
+ByteCache byteCache;
+
+// 写缓存时攒内容的缓冲区
+typedef struct
+{
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+    bool failed;
+} Writer;
+
+// 读缓存：越界、内容不合法就置failed，之后读出来的全是0
+typedef struct
+{
+    const uint8_t* data;
+    size_t size;
+    size_t position;
+    bool failed;
+} Reader;
+
+static uint8_t* input = NULL;   // 读缓存中途内存不足跳走的话，下次进来再释放
+
+bool byteCacheOption(const char* arg)
+{
+    if (strncmp(arg, "--cache-dir=", 12) != 0 || arg[12] == '\0') return false;
+    byteCache.dir = arg + 12;
+    return true;
+}
+
+// FNV-1a，64位的，源码和内容都用它
+static uint64_t hashBytes(const void* data, size_t size)
+{
+    const uint8_t* bytes = data;
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static void cachePath(char* path, size_t size, uint64_t sourceHash)
+{
+    snprintf(path, size, "%s/%016llx.loxc", byteCache.dir, (unsigned long long)sourceHash);
+}
+
+static void writeBytes(Writer* writer, const void* data, size_t size)
+{
+    if (writer->failed) return;
+    if (writer->size + size > writer->capacity)
+    {
+        size_t capacity = writer->capacity < 4096 ? 4096 : writer->capacity;
+        while (capacity < writer->size + size) capacity *= 2;
+        uint8_t* grown = realloc(writer->data, capacity);
+        if (grown == NULL)
+        {
+            writer->failed = true;      // 缓存写不成不要紧
+            return;
+        }
+        writer->data = grown;
+        writer->capacity = capacity;
+    }
+    memcpy(writer->data + writer->size, data, size);
+    writer->size += size;
+}
+
+static void writeInt(Writer* writer, uint32_t value)
+{
+    writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeString(Writer* writer, ObjString* string)
+{
+    writeInt(writer, (uint32_t)string->length);
+    writeBytes(writer, string->chars, string->length);
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function)
+{
+    writeInt(writer, (uint32_t)function->arity);
+    writeInt(writer, (uint32_t)function->upvalueCount);
+    uint8_t named = function->name != NULL;
+    writeBytes(writer, &named, 1);
+    if (named) writeString(writer, function->name);
+
+    Chunk* chunk = &function->chunk;
+    writeInt(writer, (uint32_t)chunk->count);
+    writeBytes(writer, chunk->code, chunk->count);
+    writeInt(writer, (uint32_t)chunk->lineCount);
+    writeBytes(writer, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+
+    // 编译器只往常量池里放数、字符串、函数
+    writeInt(writer, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; ++i)
+    {
+        Value value = chunk->constants.values[i];
+        uint8_t tag = IS_NUMBER(value) ? BYTECACHE_NUMBER : IS_STRING(value) ? BYTECACHE_STRING : BYTECACHE_FUNCTION;
+        writeBytes(writer, &tag, 1);
+        if (tag == BYTECACHE_NUMBER)
+        {
+            double number = AS_NUMBER(value);
+            writeBytes(writer, &number, sizeof(number));
+        }
+        else if (tag == BYTECACHE_STRING)
+        {
+            writeString(writer, AS_STRING(value));
+        }
+        else
+        {
+            writeFunction(writer, AS_FUNCTION(value));
+        }
+    }
+}
+
+// 先写临时文件再改名，别的进程不会读到写了一半的缓存
+static void store(size_t sourceLength, uint64_t sourceHash, ObjFunction* function)
+{
+    Writer writer = { NULL, 0, 0, false };
+    writeFunction(&writer, function);
+    if (writer.failed)
+    {
+        free(writer.data);
+        return;
+    }
+
+    ByteCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BYTECACHE_MAGIC, sizeof(header.magic));
+    header.version = BYTECACHE_VERSION;
+    header.opcodeCount = OPCODE_COUNT;
+    header.sourceHash = sourceHash;
+    header.sourceLength = sourceLength;
+    header.payloadSize = writer.size;
+    header.payloadHash = hashBytes(writer.data, writer.size);
+
+    char path[4096];
+    char temporary[4096 + 32];
+    cachePath(path, sizeof(path), sourceHash);
+    snprintf(temporary, sizeof(temporary), "%s.%ld.tmp", path, (long)getpid());
+
+    mkdir(byteCache.dir, 0755);     // 已经有了也没关系
+    FILE* file = fopen(temporary, "wb");
+    if (file != NULL)
+    {
+        bool written = fwrite(&header, sizeof(header), 1, file) == 1
+            && fwrite(writer.data, 1, writer.size, file) == writer.size;
+        if (fclose(file) == 0 && written && rename(temporary, path) == 0)
+        {
+            free(writer.data);
+            return;
+        }
+        remove(temporary);
+    }
+    free(writer.data);
+}
+
+static void readBytes(Reader* reader, void* out, size_t size)
+{
+    if (reader->failed || size > reader->size - reader->position)
+    {
+        reader->failed = true;
+        memset(out, 0, size);
+        return;
+    }
+    memcpy(out, reader->data + reader->position, size);
+    reader->position += size;
+}
+
+static uint32_t readInt(Reader* reader)
+{
+    uint32_t value;
+    readBytes(reader, &value, sizeof(value));
+    return value;
+}
+
+static ObjString* readString(Reader* reader)
+{
+    uint32_t length = readInt(reader);
+    if (reader->failed || length > reader->size - reader->position)
+    {
+        reader->failed = true;
+        return NULL;
+    }
+    ObjString* string = copyString((const char*)reader->data + reader->position, (int)length);
+    reader->position += length;
+    return string;
+}
+
+// 读出来的函数在栈上，读常量、名字时分配内存触发GC也不会被收走；返回前出栈
+static ObjFunction* readFunction(Reader* reader, int depth)
+{
+    if (depth > NESTING_MAX)
+    {
+        reader->failed = true;
+        return NULL;
+    }
+
+    ObjFunction* function = newFunction();
+    push(OBJ_VAL(function));
+    uint32_t arity = readInt(reader);
+    uint32_t upvalueCount = readInt(reader);
+    if (arity > 255 || upvalueCount > UINT8_COUNT) reader->failed = true;
+    function->arity = (int)arity;
+    function->upvalueCount = reader->failed ? 0 : (int)upvalueCount;
+    uint8_t named;
+    readBytes(reader, &named, 1);
+    if (named) function->name = readString(reader);
+
+    Chunk* chunk = &function->chunk;
+    uint32_t count = readInt(reader);
+    if (!reader->failed && count > 0 && count <= reader->size - reader->position)
+    {
+        chunk->code = GROW_APPLY(uint8_t, NULL, 0, count);
+        chunk->capacity = (int)count;
+        readBytes(reader, chunk->code, count);
+        chunk->count = (int)count;
+    }
+    else
+    {
+        reader->failed = true;
+    }
+
+    uint32_t lineCount = readInt(reader);
+    if (!reader->failed && lineCount > 0 && lineCount <= (reader->size - reader->position) / sizeof(LineStart))
+    {
+        chunk->lines = GROW_APPLY(LineStart, NULL, 0, lineCount);
+        chunk->lineCapacity = (int)lineCount;
+        readBytes(reader, chunk->lines, sizeof(LineStart) * lineCount);
+        chunk->lineCount = (int)lineCount;
+    }
+    else
+    {
+        reader->failed = true;
+    }
+
+    uint32_t constants = readInt(reader);
+    if (constants > UINT8_COUNT) reader->failed = true;
+    for (uint32_t i = 0; i < constants && !reader->failed; ++i)
+    {
+        uint8_t tag;
+        readBytes(reader, &tag, 1);
+        if (tag == BYTECACHE_NUMBER)
+        {
+            double number;
+            readBytes(reader, &number, sizeof(number));
+            addConstant(chunk, compactNumber(number));     // 跟编译器一样，整数还原成小整数
+        }
+        else if (tag == BYTECACHE_STRING)
+        {
+            ObjString* string = readString(reader);
+            if (string != NULL) addConstant(chunk, OBJ_VAL(string));
+        }
+        else if (tag == BYTECACHE_FUNCTION)
+        {
+            ObjFunction* nested = readFunction(reader, depth + 1);
+            if (nested != NULL) addConstant(chunk, OBJ_VAL(nested));
+        }
+        else
+        {
+            reader->failed = true;
+        }
+    }
+
+    if (!reader->failed && !verifyChunk(chunk)) reader->failed = true;
+    if (!reader->failed && flight.enabled) flightRegister(function);
+    pop();
+    return reader->failed ? NULL : function;
+}
+
+// 读缓存，对不上返回NULL；读了一半的函数没有引用，下次GC收掉
+static ObjFunction* load(size_t sourceLength, uint64_t sourceHash)
+{
+    char path[4096];
+    cachePath(path, sizeof(path), sourceHash);
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    ByteCacheHeader header;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1
+        && memcmp(header.magic, BYTECACHE_MAGIC, sizeof(header.magic)) == 0
+        && header.version == BYTECACHE_VERSION && header.opcodeCount == OPCODE_COUNT
+        && header.sourceHash == sourceHash && header.sourceLength == sourceLength
+        && header.payloadSize > 0 && header.payloadSize < ((uint64_t)1 << 32);
+
+    free(input);
+    input = valid ? malloc(header.payloadSize) : NULL;
+    valid = input != NULL && fread(input, 1, header.payloadSize, file) == header.payloadSize
+        && fgetc(file) == EOF && hashBytes(input, header.payloadSize) == header.payloadHash;
+    fclose(file);
+
+    ObjFunction* function = NULL;
+    if (valid)
+    {
+        Reader reader = { input, header.payloadSize, 0, false };
+        function = readFunction(&reader, 0);
+        if (reader.position != reader.size) function = NULL;
+    }
+    free(input);
+    input = NULL;
+    return function;
+}
+
+ObjFunction* compileCached(const char* source)
+{
+    size_t length = strlen(source);
+    uint64_t hash = hashBytes(source, length);
+
+    // 要反汇编就得真的编译一遍
+    if (!debugOptions.printCode)
+    {
+        ObjFunction* function = load(length, hash);
+        if (function != NULL) return function;
+    }
+
+    ObjFunction* function = compile(source);
+    if (function != NULL) store(length, hash, function);
+    return function;
+}
@@ -1,4 +1,7 @@
+#include <stdlib.h>
+
 #include "chunk.h"
+#include "codearena.h"
 #include "memory.h"
 #include "vm.h"
 
@@ -6,8 +9,11 @@ void initChunk(Chunk* chunk)
 {
     chunk->count = 0;
     chunk->capacity = 0;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     chunk->lines = NULL;
     chunk->code = NULL;
+    chunk->arena = NULL;
     initValueArray(&chunk->constants);
 }
 
@@ -15,22 +21,44 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line)
 {
     if (chunk->capacity < chunk->count + 1)
     {
+        // 申请成功了才改容量：内存不足跳走时块还是原样，释放时按旧容量记账
         int oldCapacity = chunk->capacity;
-        chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_APPLY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_APPLY(int, chunk->lines, oldCapacity, chunk->capacity);
+        int capacity = GROW_CAPACITY(oldCapacity);
+        chunk->code = GROW_APPLY(uint8_t, chunk->code, oldCapacity, capacity);
+        chunk->capacity = capacity;
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
+
+    // 和上一个字节同一行就不用记
+    if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) return;
+
+    if (chunk->lineCapacity < chunk->lineCount + 1)
+    {
+        int oldCapacity = chunk->lineCapacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = GROW_APPLY(LineStart, chunk->lines, oldCapacity, capacity);
+        chunk->lineCapacity = capacity;
+    }
+
+    LineStart* start = &chunk->lines[chunk->lineCount++];
+    start->offset = chunk->count - 1;
+    start->line = line;
 }
 
 void freeChunk(Chunk* chunk)
 {
-    FREE_APPLY(uint8_t, chunk->code, chunk->capacity);
-    FREE_APPLY(int, chunk->lines, chunk->capacity);
-    freeValueArray(&chunk->constants);
+    if (chunk->arena != NULL)
+    {
+        releaseCodeArena(chunk->arena);
+    }
+    else
+    {
+        FREE_APPLY(uint8_t, chunk->code, chunk->capacity);
+        FREE_APPLY(LineStart, chunk->lines, chunk->lineCapacity);
+        freeValueArray(&chunk->constants);
+    }
     initChunk(chunk);
 }
 
@@ -40,4 +68,126 @@ int addConstant(Chunk* chunk, Value value)
     writeValueArray(&chunk->constants, value);
     pop();
     return chunk->constants.count - 1;
-}
\ No newline at end of file
+}
+
+int getLine(Chunk* chunk, int offset)
+{
+    if (chunk->lineCount == 0) return 0;
+
+    // 找最后一个offset不超过要查的偏移的项，第0项的offset总是0
+    int low = 0;
+    int high = chunk->lineCount - 1;
+    while (low < high)
+    {
+        int middle = low + (high - low + 1) / 2;
+        if (chunk->lines[middle].offset <= offset) low = middle;
+        else high = middle - 1;
+    }
+    return chunk->lines[low].line;
+}
+
+int instructionLength(Chunk* chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_POP:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_INHERIT:
+            return 1;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            return 3;
+        case OP_CLOSURE:
+        {
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + 2 * function->upvalueCount;
+        }
+        default:
+            return 2;   // 一个字节的操作数：常量、局部变量槽、上值下标、参数个数
+    }
+}
+
+// 带常量下标操作数的指令
+static bool hasConstantOperand(uint8_t opcode)
+{
+    switch (opcode)
+    {
+        case OP_CONSTANT:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_CLOSURE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// 逐条走一遍，记下每条指令的开头；跳转先记着，走完再看落点
+static bool verifyInstructions(Chunk* chunk, bool* starts)
+{
+    int offset = 0;
+    int last = 0;
+    while (offset < chunk->count)
+    {
+        uint8_t opcode = chunk->code[offset];
+        if (opcode >= OPCODE_COUNT || (offset + 1 >= chunk->count && opcode != OP_RETURN)) return false;
+        if (hasConstantOperand(opcode) && chunk->code[offset + 1] >= chunk->constants.count) return false;
+        if (opcode == OP_CLOSURE && !IS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]])) return false;
+
+        int length = instructionLength(chunk, offset);
+        if (offset + length > chunk->count) return false;
+        starts[offset] = true;
+        last = offset;
+        offset += length;
+    }
+
+    for (offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+    {
+        uint8_t opcode = chunk->code[offset];
+        if (opcode != OP_JUMP && opcode != OP_JUMP_IF_FALSE && opcode != OP_LOOP) continue;
+        int distance = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+        int target = opcode == OP_LOOP ? offset + 3 - distance : offset + 3 + distance;
+        if (target < 0 || target >= chunk->count || !starts[target]) return false;
+    }
+    return chunk->code[last] == OP_RETURN;     // 最后一条指令是返回，不会从末尾跑出去
+}
+
+bool verifyChunk(Chunk* chunk)
+{
+    if (chunk->count == 0 || chunk->lineCount == 0 || chunk->lines[0].offset != 0) return false;
+    for (int i = 1; i < chunk->lineCount; ++i)
+    {
+        if (chunk->lines[i].offset <= chunk->lines[i - 1].offset || chunk->lines[i].offset >= chunk->count) return false;
+    }
+
+    bool* starts = calloc(chunk->count, sizeof(bool));
+    if (starts == NULL) return false;
+    bool valid = verifyInstructions(chunk, starts);
+    free(starts);
+    return valid;
+}
@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "codearena.h"
+#include "coverage.h"
+#include "memory.h"
+#include "vm.h"
+
+// 布局文件里一个函数的样本数
+typedef struct
+{
+    char* name;
+    uint64_t samples;
+} HotFunction;
+
+// 排版时的一个函数
+typedef struct
+{
+    ObjFunction* function;
+    uint64_t samples;
+    int order;                  // 在函数树里先序遍历的次序，样本数相同时按它排
+} Placement;
+
+static const char* layoutPath = NULL;
+static bool layoutLoaded = false;
+static HotFunction* hotFunctions = NULL;    // 按名字排序
+static int hotCount = 0;
+
+bool codeArenaOption(const char* arg)
+{
+    if (strncmp(arg, "--code-layout=", 14) != 0 || arg[14] == '\0') return false;
+    layoutPath = arg + 14;
+    return true;
+}
+
+static int compareName(const void* a, const void* b)
+{
+    return strcmp(((const HotFunction*)a)->name, ((const HotFunction*)b)->name);
+}
+
+// 读折叠栈：每行“帧;帧;...;帧 样本数”，帧是“函数名:行号”，[gc]、[vm]这些不是函数，
+// 样本算在最里层的那个Lox函数上
+static void loadLayout()
+{
+    layoutLoaded = true;
+    FILE* file = fopen(layoutPath, "r");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not open code layout profile \"%s\".\n", layoutPath);
+        return;
+    }
+
+    int capacity = 0;
+    char line[8192];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char* space = strrchr(line, ' ');
+        if (space == NULL) continue;
+        *space = '\0';
+        uint64_t samples = strtoull(space + 1, NULL, 10);
+
+        char* frame = NULL;
+        for (char* next = strtok(line, ";"); next != NULL; next = strtok(NULL, ";"))
+        {
+            if (next[0] != '[') frame = next;
+        }
+        if (frame == NULL || samples == 0) continue;
+        char* colon = strrchr(frame, ':');
+        if (colon != NULL) *colon = '\0';
+
+        // 函数不多，线性找
+        int i = 0;
+        while (i < hotCount && strcmp(hotFunctions[i].name, frame) != 0) i++;
+        if (i == hotCount)
+        {
+            if (hotCount == capacity)
+            {
+                capacity = capacity < 16 ? 16 : capacity * 2;
+                hotFunctions = realloc(hotFunctions, sizeof(HotFunction) * capacity);
+                if (hotFunctions == NULL)
+                {
+                    fprintf(stderr, "Not enough memory for the code layout profile.\n");
+                    exit(1);
+                }
+            }
+            hotFunctions[hotCount].name = strdup(frame);
+            hotFunctions[hotCount].samples = 0;
+            hotCount++;
+        }
+        hotFunctions[i].samples += samples;
+    }
+    fclose(file);
+    if (hotCount > 0) qsort(hotFunctions, hotCount, sizeof(HotFunction), compareName);
+}
+
+// 同名的函数（比如各个类的init）分不开，样本数一样
+static uint64_t samplesOf(ObjFunction* function)
+{
+    if (hotCount == 0) return 0;
+    HotFunction key = { function->name != NULL ? function->name->chars : "<script>", 0 };
+    HotFunction* found = bsearch(&key, hotFunctions, hotCount, sizeof(HotFunction), compareName);
+    return found != NULL ? found->samples : 0;
+}
+
+static int comparePlacement(const void* a, const void* b)
+{
+    const Placement* left = a;
+    const Placement* right = b;
+    if (left->samples != right->samples) return left->samples > right->samples ? -1 : 1;
+    return left->order - right->order;
+}
+
+// 嵌套定义的函数都在外层函数的常量池里
+static void measure(ObjFunction* function, int* functions, size_t* codeBytes, size_t* lineCount, int* constantCount)
+{
+    (*functions)++;
+    *codeBytes += function->chunk.count;
+    *lineCount += function->chunk.lineCount;
+    *constantCount += function->chunk.constants.count;
+    for (int i = 0; i < function->chunk.constants.count; ++i)
+    {
+        Value value = function->chunk.constants.values[i];
+        if (IS_FUNCTION(value)) measure(AS_FUNCTION(value), functions, codeBytes, lineCount, constantCount);
+    }
+}
+
+static void collectFunctions(ObjFunction* function, Placement* placements, int* count)
+{
+    Placement* placement = &placements[*count];
+    placement->function = function;
+    placement->samples = samplesOf(function);
+    placement->order = (*count)++;
+    for (int i = 0; i < function->chunk.constants.count; ++i)
+    {
+        Value value = function->chunk.constants.values[i];
+        if (IS_FUNCTION(value)) collectFunctions(AS_FUNCTION(value), placements, count);
+    }
+}
+
+static void registerCoverage(ObjFunction* function)
+{
+    coverageRegister(function);
+    for (int i = 0; i < function->chunk.constants.count; ++i)
+    {
+        Value value = function->chunk.constants.values[i];
+        if (IS_FUNCTION(value)) registerCoverage(AS_FUNCTION(value));
+    }
+}
+
+// 把函数的数组换成代码区里的，原来的数组释放掉
+static void moveChunk(Chunk* chunk, CodeArena* arena, uint8_t* code, LineStart* lines, Value* constants)
+{
+    uint8_t* oldCode = chunk->code;
+    int oldCapacity = chunk->capacity;
+    LineStart* oldLines = chunk->lines;
+    int oldLineCapacity = chunk->lineCapacity;
+    Value* oldConstants = chunk->constants.values;
+    int oldConstantCapacity = chunk->constants.capacity;
+
+    // 并发标记时标记线程可能正在读旧的常量数组，换完再释放
+    BARRIER_BEGIN();
+    chunk->code = code;
+    chunk->capacity = chunk->count;
+    chunk->lines = lines;
+    chunk->lineCapacity = chunk->lineCount;
+    chunk->constants.values = chunk->constants.count > 0 ? constants : NULL;
+    chunk->constants.capacity = chunk->constants.count;
+    chunk->arena = arena;
+    BARRIER_END();
+
+    // 缩小不会触发GC
+    FREE_APPLY(uint8_t, oldCode, oldCapacity);
+    FREE_APPLY(LineStart, oldLines, oldLineCapacity);
+    FREE_APPLY(Value, oldConstants, oldConstantCapacity);
+}
+
+void packCode(ObjFunction* script)
+{
+    if (layoutPath != NULL && !layoutLoaded) loadLayout();
+
+    int functionCount = 0;
+    size_t codeBytes = 0;
+    size_t lineCount = 0;
+    int constantCount = 0;
+    measure(script, &functionCount, &codeBytes, &lineCount, &constantCount);
+
+    // 字节码在前，行号表按LineStart对齐跟在后面；够一页的整块按页取整单独映射
+    size_t linesOffset = (codeBytes + sizeof(LineStart) - 1) / sizeof(LineStart) * sizeof(LineStart);
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = linesOffset + sizeof(LineStart) * lineCount;
+    bool mapped = size >= pageSize;
+    if (mapped) size = (size + pageSize - 1) / pageSize * pageSize;
+
+    // 三块连着申请，先整体预留，中途不会因为内存不足跳走
+    reserveMemory(sizeof(CodeArena) + sizeof(Value) * constantCount + size);
+    // 头也不能放进定长slab：整理堆会搬走slab里的块，函数的chunk.arena跟不过去
+    CodeArena* arena = GROW_APPLY(CodeArena, NULL, 0, 1);
+    arena->memory = NULL;
+    arena->size = size;
+    arena->mapped = mapped;
+    arena->constants = GROW_APPLY(Value, NULL, 0, constantCount);
+    arena->constantCount = constantCount;
+    arena->functions = functionCount;
+
+    void* memory = mapped ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+        : GROW_APPLY(uint8_t, NULL, 0, size);
+    Placement* placements = malloc(sizeof(Placement) * functionCount);
+    if (memory == MAP_FAILED || placements == NULL)
+    {
+        // 搬不了就还用各自的数组，只是没那么紧凑
+        if (!mapped) FREE_APPLY(uint8_t, memory, size);
+        else if (memory != MAP_FAILED) munmap(memory, size);
+        free(placements);
+        FREE_APPLY(Value, arena->constants, constantCount);
+        FREE_APPLY(CodeArena, arena, 1);
+        if (coverage.enabled) registerCoverage(script);
+        return;
+    }
+    arena->memory = memory;
+    if (mapped) vm.bytesAllocated += size;  // 前面预留过；堆里的申请时已经记过账
+
+    int count = 0;
+    collectFunctions(script, placements, &count);
+    if (hotCount > 0) qsort(placements, count, sizeof(Placement), comparePlacement);
+
+    uint8_t* code = arena->memory;
+    LineStart* lines = (LineStart*)(arena->memory + linesOffset);
+    Value* constants = arena->constants;
+    for (int i = 0; i < count; ++i)
+    {
+        Chunk* chunk = &placements[i].function->chunk;
+        memcpy(code, chunk->code, chunk->count);
+        memcpy(lines, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+        if (chunk->constants.count > 0)
+        {
+            memcpy(constants, chunk->constants.values, sizeof(Value) * chunk->constants.count);
+        }
+
+        uint8_t* nextCode = code + chunk->count;
+        LineStart* nextLines = lines + chunk->lineCount;
+        Value* nextConstants = constants + chunk->constants.count;
+        moveChunk(chunk, arena, code, lines, constants);
+        code = nextCode;
+        lines = nextLines;
+        constants = nextConstants;
+    }
+    free(placements);
+    if (mapped) mprotect(arena->memory, size, PROT_READ);
+
+    // 覆盖率按字节码地址认函数，搬完再登记
+    if (coverage.enabled) registerCoverage(script);
+}
+
+void releaseCodeArena(CodeArena* arena)
+{
+    if (--arena->functions > 0) return;
+
+    if (arena->mapped)
+    {
+        munmap(arena->memory, arena->size);
+        vm.bytesAllocated -= arena->size;
+    }
+    else
+    {
+        FREE_APPLY(uint8_t, arena->memory, arena->size);
+    }
+    FREE_APPLY(Value, arena->constants, arena->constantCount);
+    FREE_APPLY(CodeArena, arena, 1);
+}
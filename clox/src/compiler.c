@@ -6,10 +6,8 @@
 #include "compiler.h"
 #include "scanner.h"
 #include "memory.h"
-
-#ifdef DEBUG_PRINT_CODE
 #include "debug.h"
-#endif
+#include "flight.h"
 
 // 此法分析器
 typedef struct 
@@ -297,12 +295,11 @@ static ObjFunction* endCompiler()
     emitReturn();
     ObjFunction* function = current->function;
 
-    #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError)
+    if (debugOptions.printCode && !parser.hadError)
     {
         disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
     }
-    #endif
+    if (flight.enabled && !parser.hadError) flightRegister(function);
 
     current = current->enclosing;   // 还原回去
 
@@ -424,7 +421,7 @@ static void grouping(bool canAssign)  // 前缀表达式 （）只是用来调
 static void number(bool canAssign)
 {
     double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    emitConstant(compactNumber(value));     // 整数字面量存成小整数，循环变量一路都走整数通道
 }
 
 // 字符串Token的处理函数
@@ -1215,6 +1212,12 @@ ObjFunction* compile(const char* source)
     return parser.hadError ? NULL : function;
 }
 
+void abortCompile()
+{
+    current = NULL;
+    currentClass = NULL;
+}
+
 void markCompilerRoots()
 {
     Compiler* compiler = current;
@@ -0,0 +1,422 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "coverage.h"
+
+#define COVERAGE_HOT_LINES      20      // 报告开头列出的最热的行数
+
+// 一个函数的计数，字节码和行号在登记时拷一份，退出时函数可能已经释放了
+typedef struct
+{
+    uint8_t* key;               // 原字节码数组的地址，查表用，字节码数组不跟着对象搬家
+    int count;
+    uint8_t* code;
+    int* lines;
+    uint16_t* lengths;          // 每条指令的字节数，不是指令开头的位置为0
+    uint64_t entries;           // 进入次数
+    uint64_t* taken;            // 每条跳转指令跳走的次数，按偏移
+} CoverFunction;
+
+Coverage coverage;
+
+static CoverFunction* functions = NULL;
+static int functionCount = 0;
+static int functionCapacity = 0;
+
+// 已经释放的函数：字节码的地址以后会给别的函数用，从表里摘出来，计数留着写报告
+static CoverFunction* released = NULL;
+static int releasedCount = 0;
+static int releasedCapacity = 0;
+
+static void coverageReport();
+
+static void* allocate(size_t size)
+{
+    void* result = calloc(1, size);
+    if (result == NULL)
+    {
+        fprintf(stderr, "Not enough memory for coverage.\n");
+        exit(1);
+    }
+    return result;
+}
+
+bool coverageOption(const char* arg)
+{
+    if (strncmp(arg, "--coverage=", 11) != 0 || arg[11] == '\0') return false;
+
+    if (!coverage.enabled) atexit(coverageReport);  // 运行时错误时main直接exit，也要写出来
+    coverage.enabled = true;
+    coverage.path = arg + 11;
+    return true;
+}
+
+void coverageSource(const char* source)
+{
+    free(coverage.source);
+    coverage.source = strdup(source);
+}
+
+static uint32_t hashPointer(uint8_t* pointer)
+{
+    uint64_t bits = (uint64_t)(uintptr_t)pointer;
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+static void growFunctions()
+{
+    int oldCapacity = functionCapacity;
+    CoverFunction* old = functions;
+
+    functionCapacity = functionCapacity < 64 ? 64 : functionCapacity * 2;
+    functions = allocate(sizeof(CoverFunction) * functionCapacity);
+
+    for (int i = 0; i < oldCapacity; ++i)
+    {
+        if (old[i].key == NULL) continue;
+        uint32_t index = hashPointer(old[i].key) & (functionCapacity - 1);
+        while (functions[index].key != NULL) index = (index + 1) & (functionCapacity - 1);
+        functions[index] = old[i];
+    }
+    free(old);
+}
+
+// 找函数的计数，没登记过就现在登记
+static CoverFunction* findFunction(ObjFunction* function)
+{
+    uint8_t* key = function->chunk.code;
+    if (functionCapacity > 0)
+    {
+        uint32_t index = hashPointer(key) & (functionCapacity - 1);
+        while (functions[index].key != NULL)
+        {
+            if (functions[index].key == key) return &functions[index];
+            index = (index + 1) & (functionCapacity - 1);
+        }
+    }
+
+    if ((functionCount + 1) * 4 > functionCapacity * 3) growFunctions();
+
+    uint32_t index = hashPointer(key) & (functionCapacity - 1);
+    while (functions[index].key != NULL) index = (index + 1) & (functionCapacity - 1);
+
+    Chunk* chunk = &function->chunk;
+    CoverFunction* record = &functions[index];
+    record->key = key;
+    record->count = chunk->count;
+    record->code = allocate(chunk->count);
+    record->lines = allocate(sizeof(int) * chunk->count);
+    record->lengths = allocate(sizeof(uint16_t) * chunk->count);
+    record->taken = allocate(sizeof(uint64_t) * chunk->count);
+    memcpy(record->code, chunk->code, chunk->count);
+    for (int offset = 0; offset < chunk->count; ++offset)
+    {
+        record->lines[offset] = getLine(chunk, offset);
+    }
+    for (int offset = 0; offset < chunk->count; offset += record->lengths[offset])
+    {
+        record->lengths[offset] = (uint16_t)instructionLength(chunk, offset);
+    }
+
+    functionCount++;
+    return record;
+}
+
+void coverageRegister(ObjFunction* function)
+{
+    if (function->chunk.count > 0) findFunction(function);
+}
+
+void coverageRelease(ObjFunction* function)
+{
+    uint8_t* key = function->chunk.code;
+    if (functionCapacity == 0 || key == NULL) return;
+
+    uint32_t index = hashPointer(key) & (functionCapacity - 1);
+    while (functions[index].key != NULL && functions[index].key != key) index = (index + 1) & (functionCapacity - 1);
+    if (functions[index].key == NULL) return;
+
+    if (releasedCount + 1 > releasedCapacity)
+    {
+        releasedCapacity = releasedCapacity < 64 ? 64 : releasedCapacity * 2;
+        released = realloc(released, sizeof(CoverFunction) * releasedCapacity);
+        if (released == NULL)
+        {
+            fprintf(stderr, "Not enough memory for coverage.\n");
+            exit(1);
+        }
+    }
+    released[releasedCount++] = functions[index];
+    functionCount--;
+
+    // 线性探测不能直接挖空：后面同一串里能挪到空位上的往前挪
+    uint32_t mask = functionCapacity - 1;
+    uint32_t hole = index;
+    for (uint32_t next = (hole + 1) & mask; functions[next].key != NULL; next = (next + 1) & mask)
+    {
+        uint32_t home = hashPointer(functions[next].key) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            functions[hole] = functions[next];
+            hole = next;
+        }
+    }
+    memset(&functions[hole], 0, sizeof(CoverFunction));
+}
+
+void coverageEnter(ObjFunction* function)
+{
+    findFunction(function)->entries++;
+}
+
+void coverageJump(ObjFunction* function, uint8_t* ip)
+{
+    findFunction(function)->taken[ip - function->chunk.code]++;
+}
+
+static int jumpTarget(CoverFunction* function, int offset)
+{
+    int distance = (function->code[offset + 1] << 8) | function->code[offset + 2];
+    return function->code[offset] == OP_LOOP ? offset + 3 - distance : offset + 3 + distance;
+}
+
+// 由边计数推出每个基本块的执行次数，再把块里每条指令的次数加到它的行上
+static void countLines(CoverFunction* function, uint64_t* lineCounts, bool* hasCode)
+{
+    int count = function->count;
+    bool* leader = allocate(count + 1);
+    uint64_t* jumpsInto = allocate(sizeof(uint64_t) * (count + 1));
+
+    leader[0] = true;
+    for (int offset = 0; offset < count; offset += function->lengths[offset])
+    {
+        uint8_t opcode = function->code[offset];
+        int next = offset + function->lengths[offset];
+        if (opcode == OP_JUMP || opcode == OP_JUMP_IF_FALSE || opcode == OP_LOOP)
+        {
+            int target = jumpTarget(function, offset);
+            leader[target] = true;
+            leader[next] = true;
+            jumpsInto[target] += function->taken[offset];
+        }
+        else if (opcode == OP_RETURN)
+        {
+            leader[next] = true;
+        }
+    }
+
+    // 块的次数 = 入口（只有第一个块）+ 跳进来的 + 从上一个块顺着走下来的
+    uint64_t blockCount = 0;
+    uint64_t fallThrough = 0;
+    for (int offset = 0; offset < count; offset += function->lengths[offset])
+    {
+        if (leader[offset])
+        {
+            blockCount = (offset == 0 ? function->entries : 0) + jumpsInto[offset] + fallThrough;
+        }
+
+        int line = function->lines[offset];
+        lineCounts[line] += blockCount;
+        hasCode[line] = true;
+
+        switch (function->code[offset])
+        {
+            case OP_JUMP:
+            case OP_LOOP:
+            case OP_RETURN:
+                fallThrough = 0;
+                break;
+            case OP_JUMP_IF_FALSE:
+            {
+                uint64_t taken = function->taken[offset];
+                fallThrough = blockCount > taken ? blockCount - taken : 0;  // 中途出了运行时错误的话对不上
+                break;
+            }
+            default:
+                fallThrough = blockCount;
+                break;
+        }
+    }
+
+    free(leader);
+    free(jumpsInto);
+}
+
+static int maxLine()
+{
+    int max = 0;
+    for (int i = 0; i < functionCapacity; ++i)
+    {
+        for (int offset = 0; offset < functions[i].count; ++offset)
+        {
+            if (functions[i].lines[offset] > max) max = functions[i].lines[offset];
+        }
+    }
+    for (int i = 0; i < releasedCount; ++i)
+    {
+        for (int offset = 0; offset < released[i].count; ++offset)
+        {
+            if (released[i].lines[offset] > max) max = released[i].lines[offset];
+        }
+    }
+
+    if (coverage.source != NULL)
+    {
+        int lines = 1;
+        for (const char* c = coverage.source; *c != '\0'; ++c)
+        {
+            if (*c == '\n') lines++;
+        }
+        if (lines > max) max = lines;
+    }
+    return max;
+}
+
+static uint64_t* sortCounts;
+
+static int compareLine(const void* a, const void* b)
+{
+    uint64_t x = sortCounts[*(const int*)a];
+    uint64_t y = sortCounts[*(const int*)b];
+    if (x != y) return (y > x) - (y < x);
+    return *(const int*)a - *(const int*)b;
+}
+
+// 第line行的源码，没有源码时返回空串
+static const char* sourceLine(const char** cursor, int* length)
+{
+    if (*cursor == NULL)
+    {
+        *length = 0;
+        return "";
+    }
+
+    const char* start = *cursor;
+    const char* end = strchr(start, '\n');
+    if (end == NULL)
+    {
+        *length = (int)strlen(start);
+        *cursor = start + *length;
+    }
+    else
+    {
+        *length = (int)(end - start);
+        *cursor = end + 1;
+    }
+    return start;
+}
+
+static void writeReport(FILE* file)
+{
+    int lines = maxLine();
+    uint64_t* lineCounts = allocate(sizeof(uint64_t) * (lines + 1));
+    bool* hasCode = allocate(lines + 1);
+
+    for (int i = 0; i < functionCapacity; ++i)
+    {
+        if (functions[i].key != NULL) countLines(&functions[i], lineCounts, hasCode);
+    }
+    for (int i = 0; i < releasedCount; ++i)
+    {
+        countLines(&released[i], lineCounts, hasCode);
+    }
+
+    uint64_t total = 0;
+    int codeLines = 0;
+    int coveredLines = 0;
+    for (int line = 1; line <= lines; ++line)
+    {
+        total += lineCounts[line];
+        codeLines += hasCode[line];
+        coveredLines += hasCode[line] && lineCounts[line] > 0;
+    }
+
+    fprintf(file, "Instructions executed: %llu\n", (unsigned long long)total);
+    fprintf(file, "Lines covered: %d of %d (%.1f%%)\n\n", coveredLines, codeLines,
+        codeLines > 0 ? 100.0 * coveredLines / codeLines : 0);
+
+    // 最热的几行
+    int* order = allocate(sizeof(int) * (lines + 1));
+    for (int line = 0; line <= lines; ++line) order[line] = line;
+    sortCounts = lineCounts;
+    qsort(order, lines + 1, sizeof(int), compareLine);
+
+    fprintf(file, "Hot lines:\n%8s %16s %8s\n", "line", "instructions", "%");
+    for (int i = 0; i < COVERAGE_HOT_LINES && i <= lines && lineCounts[order[i]] > 0; ++i)
+    {
+        int line = order[i];
+        fprintf(file, "%8d %16llu %7.2f%%\n", line, (unsigned long long)lineCounts[line],
+            total > 0 ? 100.0 * lineCounts[line] / total : 0);
+    }
+
+    // 逐行清单：-是没有字节码的行，#####是有字节码但一次都没执行的行
+    fprintf(file, "\n%16s %8s %6s  source\n", "instructions", "%", "line");
+    const char* cursor = coverage.source;
+    for (int line = 1; line <= lines; ++line)
+    {
+        int length;
+        const char* text = sourceLine(&cursor, &length);
+        if (coverage.source == NULL && !hasCode[line]) continue;
+
+        if (!hasCode[line])
+        {
+            fprintf(file, "%16s %8s", "-", "");
+        }
+        else if (lineCounts[line] == 0)
+        {
+            fprintf(file, "%16s %8s", "#####", "");
+        }
+        else
+        {
+            fprintf(file, "%16llu %7.2f%%", (unsigned long long)lineCounts[line],
+                total > 0 ? 100.0 * lineCounts[line] / total : 0);
+        }
+        fprintf(file, " %6d  %.*s\n", line, length, text);
+    }
+
+    free(order);
+    free(lineCounts);
+    free(hasCode);
+}
+
+static void coverageReport()
+{
+    FILE* file = fopen(coverage.path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not open coverage output \"%s\".\n", coverage.path);
+    }
+    else
+    {
+        writeReport(file);
+        fclose(file);
+    }
+
+    for (int i = 0; i < functionCapacity; ++i)
+    {
+        free(functions[i].code);
+        free(functions[i].lines);
+        free(functions[i].lengths);
+        free(functions[i].taken);
+    }
+    for (int i = 0; i < releasedCount; ++i)
+    {
+        free(released[i].code);
+        free(released[i].lines);
+        free(released[i].lengths);
+        free(released[i].taken);
+    }
+    free(functions);
+    free(released);
+    free(coverage.source);
+    functions = NULL;
+    released = NULL;
+    coverage.source = NULL;
+    functionCount = functionCapacity = 0;
+    releasedCount = releasedCapacity = 0;
+}
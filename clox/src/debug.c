@@ -1,9 +1,22 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "debug.h"
 #include "value.h"
 #include "object.h"
 
+DebugOptions debugOptions;
+
+bool debugOption(const char* arg)
+{
+    if (strcmp(arg, "--disassemble") == 0) debugOptions.printCode = true;
+    else if (strcmp(arg, "--trace") == 0) debugOptions.traceExecution = true;
+    else if (strcmp(arg, "--gc-log") == 0) debugOptions.logGC = true;
+    else return false;
+
+    return true;
+}
+
 // 反汇编打印
 void disassembleChunk(Chunk* chunk, const char* name)
 {
@@ -58,13 +71,14 @@ int disassembleInstruction(Chunk* chunk, int offset)
 {
     printf("%04d ", offset);
 
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1))
     {
         printf("   | ");    // 同一行
     }
     else
     {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
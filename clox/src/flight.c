@@ -0,0 +1,186 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "flight.h"
+
+#define ALT_STACK_SIZE          65536   // 栈溢出时信号处理函数在这块栈上跑
+
+FlightRecorder flight;
+
+// 所有登记过的函数依次排成一段字节，信号处理函数直接write出去
+static uint8_t* symbols = NULL;
+static size_t symbolsSize = 0;
+static size_t symbolsCapacity = 0;
+static uint32_t functionCount = 0;
+
+static char alternateStack[ALT_STACK_SIZE];
+
+static const int fatalSignals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+
+// 只用write，信号处理函数里也能调
+static void writeDump(int reason, const char* message)
+{
+    int file = open(flight.path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file < 0) return;
+
+    FlightHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FLIGHT_MAGIC, sizeof(FLIGHT_MAGIC));
+    header.capacity = FLIGHT_EVENTS;
+    header.reason = reason;
+    header.head = flight.head;
+    header.symbolsSize = symbolsSize;
+    if (message != NULL)
+    {
+        size_t length = strlen(message);
+        memcpy(header.message, message, length < FLIGHT_MESSAGE ? length : FLIGHT_MESSAGE - 1);
+    }
+
+    // 写不完也没办法，尽量写
+    if (write(file, &header, sizeof(header)) == sizeof(header)
+        && write(file, flight.events, sizeof(flight.events)) == sizeof(flight.events))
+    {
+        size_t written = 0;
+        while (written < symbolsSize)
+        {
+            ssize_t count = write(file, symbols + written, symbolsSize - written);
+            if (count <= 0) break;
+            written += count;
+        }
+    }
+    close(file);
+}
+
+static void onFatalSignal(int signal)
+{
+    writeDump(signal, "fatal signal");
+    raise(signal);  // SA_RESETHAND已经换回默认处理，照常崩溃、留core
+}
+
+static void installSignals()
+{
+    stack_t stack;
+    stack.ss_sp = alternateStack;
+    stack.ss_size = ALT_STACK_SIZE;
+    stack.ss_flags = 0;
+    sigaltstack(&stack, NULL);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onFatalSignal;
+    action.sa_flags = SA_RESETHAND | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    for (size_t i = 0; i < sizeof(fatalSignals) / sizeof(fatalSignals[0]); ++i)
+    {
+        sigaction(fatalSignals[i], &action, NULL);
+    }
+}
+
+bool flightOption(const char* arg)
+{
+    if (strncmp(arg, "--flight=", 9) == 0 && arg[9] != '\0')
+    {
+        if (!flight.enabled) installSignals();
+        flight.enabled = true;
+        flight.path = arg + 9;
+        return true;
+    }
+    if (strncmp(arg, "--flight-sample=", 16) == 0)
+    {
+        flight.sample = atoi(arg + 16);
+        return flight.sample > 0;
+    }
+    return false;
+}
+
+static void append(const void* data, size_t size)
+{
+    if (symbolsSize + size > symbolsCapacity)
+    {
+        size_t capacity = symbolsCapacity < 4096 ? 4096 : symbolsCapacity;
+        while (capacity < symbolsSize + size) capacity *= 2;
+        uint8_t* grown = realloc(symbols, capacity);
+        if (grown == NULL)
+        {
+            fprintf(stderr, "Not enough memory for the flight recorder.\n");
+            exit(1);
+        }
+        symbols = grown;        // 信号正好在这里来的话，转储里的登记数据可能不全
+        symbolsCapacity = capacity;
+    }
+    memcpy(symbols + symbolsSize, data, size);
+    symbolsSize += size;
+}
+
+static void appendInt(uint32_t value)
+{
+    append(&value, sizeof(value));
+}
+
+static void appendString(const char* chars, int length)
+{
+    appendInt((uint32_t)length);
+    append(chars, length);
+}
+
+// 一个函数：编号、名字、字节码、行号表、常量
+void flightRegister(ObjFunction* function)
+{
+    function->id = ++functionCount;
+
+    Chunk* chunk = &function->chunk;
+    appendInt(function->id);
+    if (function->name == NULL) appendString("<script>", 8);
+    else appendString(function->name->chars, function->name->length);
+    appendInt((uint32_t)chunk->count);
+    append(chunk->code, chunk->count);
+    appendInt((uint32_t)chunk->lineCount);
+    append(chunk->lines, sizeof(LineStart) * chunk->lineCount);
+
+    appendInt((uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; ++i)
+    {
+        Value value = chunk->constants.values[i];
+        uint8_t tag;
+        if (IS_NIL(value)) tag = FLIGHT_CONSTANT_NIL;
+        else if (IS_BOOL(value)) tag = AS_BOOL(value) ? FLIGHT_CONSTANT_TRUE : FLIGHT_CONSTANT_FALSE;
+        else if (IS_NUMBER(value)) tag = FLIGHT_CONSTANT_NUMBER;
+        else if (IS_STRING(value)) tag = FLIGHT_CONSTANT_STRING;
+        else tag = FLIGHT_CONSTANT_FUNCTION;   // 常量池里别的对象只有函数
+        append(&tag, 1);
+
+        if (tag == FLIGHT_CONSTANT_NUMBER)
+        {
+            double number = AS_NUMBER(value);
+            append(&number, sizeof(number));
+        }
+        else if (tag == FLIGHT_CONSTANT_STRING)
+        {
+            appendString(AS_STRING(value)->chars, AS_STRING(value)->length);
+        }
+        else if (tag == FLIGHT_CONSTANT_FUNCTION)
+        {
+            ObjString* name = IS_FUNCTION(value) ? AS_FUNCTION(value)->name : NULL;
+            if (name == NULL) appendString("?", 1);
+            else appendString(name->chars, name->length);
+        }
+    }
+}
+
+void flightInstruction(ObjFunction* function, uint8_t* ip, int depth)
+{
+    uint32_t offset = (uint32_t)(ip - function->chunk.code);
+    flightRecord(FLIGHT_INSTRUCTION, depth, function->id, offset, 0);
+    flight.events[(flight.head - 1) & (FLIGHT_EVENTS - 1)].opcode = *ip;
+}
+
+void flightError(ObjFunction* function, uint8_t* ip, int depth, const char* message)
+{
+    uint32_t offset = function != NULL ? (uint32_t)(ip - function->chunk.code) : 0;
+    flightRecord(FLIGHT_ERROR, depth, function != NULL ? function->id : 0, offset, 0);
+    writeDump(0, message);
+}
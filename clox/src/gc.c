@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gc.h"
+#include "vm.h"
+
+#define GC_GROW_FACTOR_MIN      1.1     // 为了压停顿收缩增长系数时的下限，再小就几乎每次分配都GC
+
+GCPolicy gcPolicy = {
+    .initialHeap = 1024 * 1024,
+    .growFactor = 2,
+    .maxHeap = 0,
+    .targetPause = 0,
+    .statsPath = NULL,
+};
+
+GCStats gcStats;
+
+static FILE* statsFile = NULL;
+static double startTime = -1;
+static double lastFactor = 0;           // 上一轮实际用的增长系数
+
+static const char* typeNames[GC_OBJ_TYPES] = {
+    [OBJ_BOUND_METHOD] = "bound_method",
+    [OBJ_NATIVE] = "native",
+    [OBJ_INSTANCE] = "instance",
+    [OBJ_CLASS] = "class",
+    [OBJ_FUNCTION] = "function",
+    [OBJ_CLOSURE] = "closure",
+    [OBJ_STRING] = "string",
+    [OBJ_UPVALUE] = "upvalue",
+};
+
+// 单调时钟，毫秒
+double gcNow()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+// 解析字节数，支持K、M、G后缀
+static bool parseSize(const char* text, size_t* result)
+{
+    char* end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) return false;
+
+    switch (*end)
+    {
+        case 'k': case 'K': value *= 1024; end++; break;
+        case 'm': case 'M': value *= 1024 * 1024; end++; break;
+        case 'g': case 'G': value *= 1024.0 * 1024 * 1024; end++; break;
+    }
+    if (*end == 'B' || *end == 'b') end++;
+    if (*end != '\0') return false;
+
+    *result = (size_t)value;
+    return true;
+}
+
+static bool parseNumber(const char* text, double* result)
+{
+    char* end;
+    double value = strtod(text, &end);
+    if (end == text || *end != '\0' || value < 0) return false;
+
+    *result = value;
+    return true;
+}
+
+// 按名字设置一项策略，名字和环境变量、命令行共用
+static bool setPolicy(const char* name, const char* value)
+{
+    if (strcmp(name, "initial-heap") == 0)
+    {
+        return parseSize(value, &gcPolicy.initialHeap) && gcPolicy.initialHeap > 0;
+    }
+    if (strcmp(name, "grow-factor") == 0)
+    {
+        return parseNumber(value, &gcPolicy.growFactor) && gcPolicy.growFactor >= GC_GROW_FACTOR_MIN;
+    }
+    if (strcmp(name, "max-heap") == 0)
+    {
+        return parseSize(value, &gcPolicy.maxHeap);
+    }
+    if (strcmp(name, "target-pause") == 0)
+    {
+        return parseNumber(value, &gcPolicy.targetPause);
+    }
+    if (strcmp(name, "stats") == 0)
+    {
+        gcPolicy.statsPath = value;
+        return *value != '\0';
+    }
+    return false;
+}
+
+void gcPolicyFromEnv()
+{
+    static const struct { const char* env; const char* name; } vars[] = {
+        { "LOX_GC_INITIAL_HEAP", "initial-heap" },
+        { "LOX_GC_GROW_FACTOR", "grow-factor" },
+        { "LOX_GC_MAX_HEAP", "max-heap" },
+        { "LOX_GC_TARGET_PAUSE", "target-pause" },
+        { "LOX_GC_STATS", "stats" },
+    };
+
+    for (size_t i = 0; i < sizeof(vars) / sizeof(vars[0]); ++i)
+    {
+        const char* value = getenv(vars[i].env);
+        if (value == NULL) continue;
+        if (!setPolicy(vars[i].name, value))
+        {
+            fprintf(stderr, "Ignoring invalid %s=\"%s\".\n", vars[i].env, value);
+        }
+    }
+}
+
+bool gcPolicyOption(const char* arg)
+{
+    if (strncmp(arg, "--gc-", 5) != 0) return false;
+
+    const char* equals = strchr(arg, '=');
+    if (equals == NULL) return false;
+
+    char name[32];
+    size_t length = (size_t)(equals - (arg + 5));
+    if (length >= sizeof(name)) return false;
+    memcpy(name, arg + 5, length);
+    name[length] = '\0';
+
+    return setPolicy(name, equals + 1);
+}
+
+// 打开遥测文件，第一次用到时才打开
+static FILE* openStats()
+{
+    if (statsFile == NULL && gcPolicy.statsPath != NULL)
+    {
+        statsFile = fopen(gcPolicy.statsPath, "w");
+        if (statsFile == NULL)
+        {
+            fprintf(stderr, "Could not open GC stats file \"%s\".\n", gcPolicy.statsPath);
+            gcPolicy.statsPath = NULL;
+        }
+    }
+    return statsFile;
+}
+
+void gcRecordPause(double pause)
+{
+    if (startTime < 0) startTime = gcNow() - pause;
+
+    gcStats.totalPause += pause;
+    gcStats.lastPause = pause;
+    if (pause > gcStats.maxPause) gcStats.maxPause = pause;
+}
+
+// 下一次GC的阈值
+// 标记时间只和存活对象有关，停顿超了目标能压的只有清理：GC间隔短，要清的垃圾就少
+static size_t nextThreshold(double markTime, double sweepTime)
+{
+    if (lastFactor == 0) lastFactor = gcPolicy.growFactor;
+
+    double factor = gcPolicy.growFactor;
+    if (gcPolicy.targetPause > markTime && sweepTime > 0)   // 光标记就超了的话，收得再勤也没用
+    {
+        // 清理时间大致和上一轮攒下的垃圾成正比，也就是和(系数-1)成正比
+        double scale = (gcPolicy.targetPause - markTime) / sweepTime;
+        factor = 1 + (lastFactor - 1) * scale;
+        if (factor < GC_GROW_FACTOR_MIN) factor = GC_GROW_FACTOR_MIN;
+        if (factor > gcPolicy.growFactor) factor = gcPolicy.growFactor;
+    }
+    lastFactor = factor;
+
+    size_t next = (size_t)(vm.bytesAllocated * factor);
+    if (gcPolicy.maxHeap > 0 && next > gcPolicy.maxHeap && vm.bytesAllocated < gcPolicy.maxHeap)
+    {
+        next = gcPolicy.maxHeap;    // 快到上限了就收得勤一点
+    }
+    return next;
+}
+
+void gcRecordCycle(size_t bytesBefore, double markTime, double sweepTime)
+{
+    double pause = markTime + sweepTime;
+    gcRecordPause(pause);
+
+    size_t freedBytes = bytesBefore - vm.bytesAllocated;
+    gcStats.collections++;
+    gcStats.totalFreedBytes += freedBytes;
+    vm.nextGC = nextThreshold(markTime, sweepTime);
+
+    FILE* file = openStats();
+    if (file != NULL)
+    {
+        fprintf(file, "gc seq=%zu time_ms=%.3f mark_ms=%.3f sweep_ms=%.3f pause_ms=%.3f before=%zu after=%zu "
+            "freed=%zu next=%zu total_pause_ms=%.3f", gcStats.collections, gcNow() - startTime, markTime, sweepTime,
+            pause, bytesBefore, vm.bytesAllocated, freedBytes, vm.nextGC, gcStats.totalPause);
+        for (int type = 0; type < GC_OBJ_TYPES; ++type)
+        {
+            fprintf(file, " freed_%s=%zu", typeNames[type], gcStats.cycleFreed[type]);
+        }
+        fputc('\n', file);
+    }
+
+    for (int type = 0; type < GC_OBJ_TYPES; ++type)
+    {
+        gcStats.totalFreed[type] += gcStats.cycleFreed[type];
+        gcStats.cycleFreed[type] = 0;
+    }
+}
+
+bool gcStatValue(const char* name, double* value)
+{
+    if (strcmp(name, "collections") == 0) *value = (double)gcStats.collections;
+    else if (strcmp(name, "allocations") == 0) *value = (double)gcStats.allocations;
+    else if (strcmp(name, "bytesAllocated") == 0) *value = (double)vm.bytesAllocated;
+    else if (strcmp(name, "nextGC") == 0) *value = (double)vm.nextGC;
+    else if (strcmp(name, "totalPauseMs") == 0) *value = gcStats.totalPause;
+    else if (strcmp(name, "maxPauseMs") == 0) *value = gcStats.maxPause;
+    else if (strcmp(name, "lastPauseMs") == 0) *value = gcStats.lastPause;
+    else if (strcmp(name, "freedBytes") == 0) *value = (double)gcStats.totalFreedBytes;
+    else if (strncmp(name, "freed.", 6) == 0)
+    {
+        for (int type = 0; type < GC_OBJ_TYPES; ++type)
+        {
+            if (strcmp(name + 6, typeNames[type]) == 0)
+            {
+                *value = (double)gcStats.totalFreed[type];
+                return true;
+            }
+        }
+        return false;
+    }
+    else return false;
+
+    return true;
+}
+
+void gcCloseStats()
+{
+    if (statsFile != NULL)
+    {
+        fclose(statsFile);
+        statsFile = NULL;
+    }
+}
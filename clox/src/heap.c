@@ -0,0 +1,520 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "heap.h"
+
+#define PAGE_HEADER_SIZE    ((sizeof(HeapPage) + HEAP_GRANULE - 1) & ~(HEAP_GRANULE - 1))
+#define OS_PAGE_SIZE        4096    // 页头所在的系统页不还，空页池靠它串起来
+#define HOT_EMPTY_PAGES     16      // 空页池里这么多页不还给系统，免得每轮GC都madvise再缺页
+
+// 一种槽大小的一串页
+typedef struct Slab
+{
+    uint32_t slotSize;
+    bool objects;           // 放的是对象（参与清理）还是定长附属内存（显式释放）
+    HeapPage* pages;
+    HeapPage* current;      // 正在从哪一页分配，清理后回到链表头
+} Slab;
+
+typedef struct
+{
+    Slab objectSlabs[HEAP_OBJ_TYPES];       // 每种对象类型一个slab
+    Slab fixedSlabs[HEAP_SIZE_CLASSES];     // 附属内存按16字节一档
+    HeapPage* largePages;
+    HeapPage* hotPages;                     // 空页池：物理内存还留着的
+    int hotCount;
+    HeapPage* coldPages;                    // 空页池：已经madvise还给系统，留着地址复用
+    HeapPage* evacuating;                   // 整理中从slab上摘下来等着腾空的页
+} Heap;
+
+static Heap heap;
+
+#ifdef GC_COMPRESSED_REFS
+
+char* heapBase = NULL;
+static size_t reserveTop;   // 保留区里已经划出去的字节数
+
+// 所有页都从一段保留地址里顺序划出来，对象引用才能压成相对基址的32位偏移
+static void* mapAligned(size_t size)
+{
+    if (heapBase == NULL)
+    {
+        size_t span = HEAP_RESERVE_SIZE + HEAP_PAGE_SIZE;
+        char* raw = (char*)mmap(NULL, span, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (raw == MAP_FAILED) exit(1);
+
+        heapBase = (char*)(((uintptr_t)raw + HEAP_PAGE_SIZE - 1) & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+        if (heapBase > raw) munmap(raw, heapBase - raw);
+        char* end = raw + span;
+        if (end > heapBase + HEAP_RESERVE_SIZE) munmap(heapBase + HEAP_RESERVE_SIZE, end - (heapBase + HEAP_RESERVE_SIZE));
+        reserveTop = HEAP_PAGE_SIZE;    // 第一页空着，偏移0留给NULL
+    }
+
+    if (reserveTop + size > HEAP_RESERVE_SIZE) exit(1);
+
+    char* result = heapBase + reserveTop;
+    if (mprotect(result, size, PROT_READ | PROT_WRITE) != 0) exit(1);
+    reserveTop += size;
+    return result;
+}
+
+// 地址不还，还了保留区就有洞了，只把物理内存还回去
+static void unmapRange(void* start, size_t size)
+{
+    madvise(start, size, MADV_DONTNEED);
+}
+
+#else
+
+// 映射一块按HEAP_PAGE_SIZE对齐的内存：多映射一页再把两头裁掉
+static void* mapAligned(size_t size)
+{
+    size_t span = size + HEAP_PAGE_SIZE;
+    char* raw = (char*)mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) exit(1);
+
+    char* aligned = (char*)(((uintptr_t)raw + HEAP_PAGE_SIZE - 1) & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+    if (aligned > raw) munmap(raw, aligned - raw);
+    char* end = raw + span;
+    if (end > aligned + size) munmap(aligned + size, end - (aligned + size));
+    return aligned;
+}
+
+static void unmapRange(void* start, size_t size)
+{
+    munmap(start, size);
+}
+
+#endif
+
+static void initPage(HeapPage* page, Slab* slab, size_t mapSize, size_t slotSize)
+{
+    page->next = NULL;
+    page->slab = slab;
+    page->mapSize = mapSize;
+    page->slotSize = (uint32_t)slotSize;
+    page->slotCount = slab == NULL ? 1 : (uint32_t)((HEAP_PAGE_SIZE - PAGE_HEADER_SIZE) / slotSize);
+    page->liveCount = 0;
+    page->bump = 0;
+    page->freeList = NULL;
+    page->evacuating = false;
+    page->slots = (char*)page + PAGE_HEADER_SIZE;
+    memset(page->markBits, 0, sizeof(page->markBits));
+    memset(page->allocBits, 0, sizeof(page->allocBits));
+}
+
+static HeapPage* newPage(Slab* slab)
+{
+    HeapPage* page;
+    if (heap.hotPages != NULL)
+    {
+        page = heap.hotPages;
+        heap.hotPages = page->next;
+        heap.hotCount--;
+    }
+    else if (heap.coldPages != NULL)
+    {
+        page = heap.coldPages;
+        heap.coldPages = page->next;
+    }
+    else
+    {
+        page = (HeapPage*)mapAligned(HEAP_PAGE_SIZE);
+    }
+
+    initPage(page, slab, HEAP_PAGE_SIZE, slab->slotSize);
+    page->next = slab->pages;
+    slab->pages = page;
+    return page;
+}
+
+// 先用释放过的槽，再用没用过的
+static void* takeSlot(HeapPage* page)
+{
+    void* slot = page->freeList;
+    if (slot != NULL)
+    {
+        page->freeList = *(void**)slot;
+    }
+    else if (page->bump < page->slotCount)
+    {
+        slot = page->slots + (size_t)page->bump * page->slotSize;
+        page->bump++;
+    }
+    else
+    {
+        return NULL;
+    }
+
+    size_t granule = granuleOf(page, (Obj*)slot);
+    page->allocBits[granule / 64] |= (uint64_t)1 << (granule % 64);
+    page->liveCount++;
+    return slot;
+}
+
+static void* slabAllocate(Slab* slab)
+{
+    HeapPage* page = slab->current;
+    while (page != NULL)
+    {
+        void* slot = takeSlot(page);
+        if (slot != NULL) return slot;
+        page = page->next;  // 这一页满了，往后找还有空位的页
+        slab->current = page;
+    }
+
+    page = newPage(slab);
+    slab->current = page;
+    return takeSlot(page);
+}
+
+// 大对象单独占一段映射，对象仍然紧跟页头，pageOf照样能找到它
+static Obj* allocateLarge(size_t size)
+{
+    size_t mapSize = (PAGE_HEADER_SIZE + size + HEAP_PAGE_SIZE - 1) & ~(HEAP_PAGE_SIZE - 1);
+    HeapPage* page = (HeapPage*)mapAligned(mapSize);
+    initPage(page, NULL, mapSize, size);
+    page->next = heap.largePages;
+    heap.largePages = page;
+
+    page->allocBits[0] = 1;
+    page->liveCount = 1;
+    return (Obj*)page->slots;
+}
+
+Obj* heapAllocate(size_t size, ObjType type)
+{
+    size = heapSlotSize(size);
+    if (size > HEAP_SMALL_MAX) return allocateLarge(size);
+
+    Slab* slab = &heap.objectSlabs[type];
+    if (slab->slotSize == 0)    // 第一次分配这种对象
+    {
+        slab->slotSize = (uint32_t)size;
+        slab->objects = true;
+    }
+    return (Obj*)slabAllocate(slab);
+}
+
+void* heapAllocateFixed(size_t size)
+{
+    size = heapSlotSize(size);
+    Slab* slab = &heap.fixedSlabs[(size >> HEAP_GRANULE_SHIFT) - 1];
+    slab->slotSize = (uint32_t)size;
+    return slabAllocate(slab);
+}
+
+// 空页放回池子，池子里热页够多了就还给系统：页头留着，后面的物理内存交还
+static void releasePage(HeapPage* page)
+{
+    if (heap.hotCount < HOT_EMPTY_PAGES)
+    {
+        page->next = heap.hotPages;
+        heap.hotPages = page;
+        heap.hotCount++;
+        return;
+    }
+
+    madvise((char*)page + OS_PAGE_SIZE, HEAP_PAGE_SIZE - OS_PAGE_SIZE, MADV_DONTNEED);
+    page->next = heap.coldPages;
+    heap.coldPages = page;
+}
+
+// 从slab里摘掉空页还给系统
+static void unlinkPage(Slab* slab, HeapPage* page)
+{
+    HeapPage** link = &slab->pages;
+    while (*link != page) link = &(*link)->next;
+    *link = page->next;
+    if (slab->current == page) slab->current = slab->pages;
+    releasePage(page);
+}
+
+void heapFreeFixed(void* pointer)
+{
+    HeapPage* page = pageOf((Obj*)pointer);
+    size_t granule = granuleOf(page, (Obj*)pointer);
+    page->allocBits[granule / 64] &= ~((uint64_t)1 << (granule % 64));
+
+    *(void**)pointer = page->freeList;
+    page->freeList = pointer;
+
+    // 正在分配的页留着，免得一申请一释放就来回madvise
+    if (--page->liveCount == 0 && page != page->slab->current) unlinkPage(page->slab, page);
+}
+
+// 清理一页：只看 分配了&&没标记 的位，活对象一个都不碰，死对象的槽挂到空闲链表上
+static size_t sweepPage(HeapPage* page, void (*finalize)(Obj*))
+{
+    size_t freed = 0;
+    for (size_t word = 0; word < HEAP_BITMAP_WORDS; ++word)
+    {
+        uint64_t dead = page->allocBits[word] & ~page->markBits[word];
+        if (dead == 0) continue;
+
+        page->allocBits[word] &= ~dead;
+        while (dead != 0)
+        {
+            size_t granule = word * 64 + (size_t)__builtin_ctzll(dead);
+            dead &= dead - 1;
+
+            void* slot = page->slots + (granule << HEAP_GRANULE_SHIFT);
+            finalize((Obj*)slot);
+            *(void**)slot = page->freeList;
+            page->freeList = slot;
+            page->liveCount--;
+            freed += page->slotSize;
+        }
+    }
+
+    memset(page->markBits, 0, sizeof(page->markBits));  // 为下一轮做准备
+    return freed;
+}
+
+size_t heapSweep(void (*finalize)(Obj*))
+{
+    size_t freed = 0;
+    for (int type = 0; type < HEAP_OBJ_TYPES; ++type)
+    {
+        Slab* slab = &heap.objectSlabs[type];
+        HeapPage** link = &slab->pages;
+        while (*link != NULL)
+        {
+            HeapPage* page = *link;
+            freed += sweepPage(page, finalize);
+            if (page->liveCount == 0)
+            {
+                *link = page->next;
+                releasePage(page);
+            }
+            else
+            {
+                link = &page->next;
+            }
+        }
+        slab->current = slab->pages;
+    }
+
+    // 附属内存是显式释放的，清理只需要让分配从头再找一遍空位
+    for (int sizeClass = 0; sizeClass < HEAP_SIZE_CLASSES; ++sizeClass)
+    {
+        heap.fixedSlabs[sizeClass].current = heap.fixedSlabs[sizeClass].pages;
+    }
+
+    HeapPage** link = &heap.largePages;
+    while (*link != NULL)
+    {
+        HeapPage* page = *link;
+        freed += sweepPage(page, finalize);
+        if (page->liveCount == 0)
+        {
+            *link = page->next;
+            unmapRange(page, page->mapSize);
+        }
+        else
+        {
+            link = &page->next;
+        }
+    }
+
+    return freed;
+}
+
+// 遍历一页上的对象
+static void visitPage(HeapPage* page, void (*visit)(Obj*))
+{
+    for (size_t word = 0; word < HEAP_BITMAP_WORDS; ++word)
+    {
+        uint64_t live = page->allocBits[word];
+        while (live != 0)
+        {
+            size_t granule = word * 64 + (size_t)__builtin_ctzll(live);
+            live &= live - 1;
+            visit((Obj*)(page->slots + (granule << HEAP_GRANULE_SHIFT)));
+        }
+    }
+}
+
+static void unmapPages(HeapPage* page, void (*finalize)(Obj*))
+{
+    while (page != NULL)
+    {
+        HeapPage* next = page->next;
+        if (finalize != NULL) visitPage(page, finalize);     // 只为释放附属内存访问对象，对象本身随页一起释放
+        unmapRange(page, page->mapSize);
+        page = next;
+    }
+}
+
+void freeHeap(void (*finalize)(Obj*))
+{
+    for (int type = 0; type < HEAP_OBJ_TYPES; ++type)
+    {
+        unmapPages(heap.objectSlabs[type].pages, finalize);
+    }
+    unmapPages(heap.largePages, finalize);
+
+    // 对象释放附属内存时还会用到附属内存的slab，最后再拆
+    for (int sizeClass = 0; sizeClass < HEAP_SIZE_CLASSES; ++sizeClass)
+    {
+        unmapPages(heap.fixedSlabs[sizeClass].pages, NULL);
+    }
+    unmapPages(heap.hotPages, NULL);
+    unmapPages(heap.coldPages, NULL);
+
+    #ifdef GC_COMPRESSED_REFS
+    if (heapBase != NULL) munmap(heapBase, HEAP_RESERVE_SIZE);
+    heapBase = NULL;
+    #endif
+
+    memset(&heap, 0, sizeof(heap));
+}
+
+// 统计对象slab的槽位使用情况
+double heapFragmentation()
+{
+    size_t capacity = 0;
+    size_t live = 0;
+    for (int type = 0; type < HEAP_OBJ_TYPES; ++type)
+    {
+        for (HeapPage* page = heap.objectSlabs[type].pages; page != NULL; page = page->next)
+        {
+            capacity += page->slotCount;
+            live += page->liveCount;
+        }
+    }
+    return capacity == 0 ? 0.0 : 1.0 - (double)live / (double)capacity;
+}
+
+static int compareLiveCount(const void* a, const void* b)
+{
+    uint32_t left = (*(HeapPage* const*)a)->liveCount;
+    uint32_t right = (*(HeapPage* const*)b)->liveCount;
+    return left < right ? 1 : (left > right ? -1 : 0);     // 满的在前
+}
+
+// 一个slab里的对象挤进最少的页够用，剩下最稀疏的那些页腾空
+static bool planSlab(Slab* slab)
+{
+    size_t pageCount = 0;
+    size_t live = 0;
+    for (HeapPage* page = slab->pages; page != NULL; page = page->next)
+    {
+        pageCount++;
+        live += page->liveCount;
+    }
+    if (pageCount < 2) return false;
+
+    size_t slotsPerPage = slab->pages->slotCount;
+    size_t needed = (live + slotsPerPage - 1) / slotsPerPage;
+    if (needed == 0) needed = 1;
+    if (needed >= pageCount) return false;
+
+    HeapPage** pages = (HeapPage**)malloc(sizeof(HeapPage*) * pageCount);
+    if (pages == NULL) exit(1);
+    size_t count = 0;
+    for (HeapPage* page = slab->pages; page != NULL; page = page->next)
+    {
+        pages[count++] = page;
+    }
+    qsort(pages, count, sizeof(HeapPage*), compareLiveCount);
+
+    // 留下的页重新串回slab，要腾空的页挂到heap.evacuating上
+    slab->pages = NULL;
+    for (size_t i = count; i > 0; --i)
+    {
+        HeapPage* page = pages[i - 1];
+        if (i - 1 < needed)
+        {
+            page->next = slab->pages;
+            slab->pages = page;
+        }
+        else
+        {
+            page->evacuating = true;
+            page->next = heap.evacuating;
+            heap.evacuating = page;
+        }
+    }
+    slab->current = slab->pages;
+
+    free(pages);
+    return true;
+}
+
+bool heapPlanCompaction()
+{
+    bool planned = false;
+    for (int type = 0; type < HEAP_OBJ_TYPES; ++type)
+    {
+        if (planSlab(&heap.objectSlabs[type])) planned = true;
+    }
+    for (int sizeClass = 0; sizeClass < HEAP_SIZE_CLASSES; ++sizeClass)
+    {
+        if (planSlab(&heap.fixedSlabs[sizeClass])) planned = true;
+    }
+    return planned;
+}
+
+void heapEvacuate()
+{
+    for (HeapPage* page = heap.evacuating; page != NULL; page = page->next)
+    {
+        if (!page->slab->objects) continue;     // 附属内存等修对象的时候跟着主人一起搬
+
+        for (size_t word = 0; word < HEAP_BITMAP_WORDS; ++word)
+        {
+            uint64_t live = page->allocBits[word];
+            while (live != 0)
+            {
+                size_t granule = word * 64 + (size_t)__builtin_ctzll(live);
+                live &= live - 1;
+
+                Obj* from = (Obj*)(page->slots + (granule << HEAP_GRANULE_SHIFT));
+                Obj* to = (Obj*)slabAllocate(page->slab);
+                memcpy(to, from, page->slotSize);
+                *(Obj**)from = to;  // 转发地址
+            }
+        }
+    }
+}
+
+void* heapRelocateFixed(void* pointer)
+{
+    if (pointer == NULL) return NULL;
+
+    HeapPage* page = pageOf((Obj*)pointer);
+    if (!page->evacuating) return pointer;
+
+    void* moved = slabAllocate(page->slab);
+    memcpy(moved, pointer, page->slotSize);
+    return moved;
+}
+
+void heapForEachObject(void (*visit)(Obj*))
+{
+    for (int type = 0; type < HEAP_OBJ_TYPES; ++type)
+    {
+        for (HeapPage* page = heap.objectSlabs[type].pages; page != NULL; page = page->next)
+        {
+            visitPage(page, visit);
+        }
+    }
+    for (HeapPage* page = heap.largePages; page != NULL; page = page->next)
+    {
+        visitPage(page, visit);
+    }
+}
+
+void heapFinishCompaction()
+{
+    HeapPage* page = heap.evacuating;
+    while (page != NULL)
+    {
+        HeapPage* next = page->next;
+        releasePage(page);
+        page = next;
+    }
+    heap.evacuating = NULL;
+}
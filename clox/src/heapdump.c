@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+#include "heapdump.h"
+#include "table.h"
+#include "vm.h"
+
+#define SUMMARY_CHARS           40      // 字符串摘要最多写几个字符
+#define LABEL_MAX               64
+
+// 走到过的对象：第一次走到时记下父对象和边
+typedef struct
+{
+    Obj* object;
+    int parent;
+    char label[LABEL_MAX];
+} Node;
+
+volatile sig_atomic_t heapDumpPending = 0;
+
+static const char* signalPath = NULL;
+static int signalDumps = 0;
+
+static Node* nodes = NULL;      // 下标就是id，0号是根
+static int nodeCount = 0;
+static int nodeCapacity = 0;
+static int* lookup = NULL;      // 对象地址 -> id，开放寻址
+static int lookupCapacity = 0;
+static FILE* output = NULL;
+static int current = 0;         // 正在写出边的对象，0表示在写根
+
+static void onDumpSignal(int signal)
+{
+    (void)signal;
+    heapDumpPending = 1;
+}
+
+bool heapDumpOption(const char* arg)
+{
+    if (strncmp(arg, "--heap-dump=", 12) != 0 || arg[12] == '\0') return false;
+
+    signalPath = arg + 12;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onDumpSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(HEAP_DUMP_SIGNAL, &action, NULL);
+    return true;
+}
+
+void heapDumpDrain()
+{
+    heapDumpPending = 0;
+    if (signalPath == NULL) return;
+
+    char path[4096];
+    if (++signalDumps == 1)
+    {
+        snprintf(path, sizeof(path), "%s", signalPath);
+    }
+    else
+    {
+        snprintf(path, sizeof(path), "%s.%d", signalPath, signalDumps);
+    }
+
+    int objects = dumpHeap(path);
+    if (objects < 0)
+    {
+        fprintf(stderr, "Could not write heap snapshot \"%s\".\n", path);
+    }
+    else
+    {
+        fprintf(stderr, "Wrote heap snapshot \"%s\" (%d objects).\n", path, objects);
+    }
+}
+
+static void* allocate(size_t size)
+{
+    void* result = calloc(1, size);
+    if (result == NULL)
+    {
+        fprintf(stderr, "Not enough memory for the heap snapshot.\n");
+        exit(1);
+    }
+    return result;
+}
+
+static uint32_t hashPointer(Obj* pointer)
+{
+    uint64_t bits = (uint64_t)(uintptr_t)pointer;
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+static void growLookup()
+{
+    free(lookup);
+    lookupCapacity = lookupCapacity < 1024 ? 1024 : lookupCapacity * 2;
+    lookup = allocate(sizeof(int) * lookupCapacity);
+
+    for (int id = 1; id < nodeCount; ++id)
+    {
+        uint32_t slot = hashPointer(nodes[id].object) & (lookupCapacity - 1);
+        while (lookup[slot] != 0) slot = (slot + 1) & (lookupCapacity - 1);
+        lookup[slot] = id;
+    }
+}
+
+// 对象的id，第一次走到就编号、排进广度优先的队列（nodes本身就是队列）
+static int nodeId(Obj* object, const char* label)
+{
+    if (lookupCapacity > 0)
+    {
+        uint32_t slot = hashPointer(object) & (lookupCapacity - 1);
+        while (lookup[slot] != 0)
+        {
+            if (nodes[lookup[slot]].object == object) return lookup[slot];
+            slot = (slot + 1) & (lookupCapacity - 1);
+        }
+    }
+
+    if (nodeCount + 1 > nodeCapacity)
+    {
+        nodeCapacity = nodeCapacity < 1024 ? 1024 : nodeCapacity * 2;
+        nodes = realloc(nodes, sizeof(Node) * nodeCapacity);
+        if (nodes == NULL)
+        {
+            fprintf(stderr, "Not enough memory for the heap snapshot.\n");
+            exit(1);
+        }
+    }
+
+    Node* node = &nodes[nodeCount];
+    node->object = object;
+    node->parent = current;
+    snprintf(node->label, LABEL_MAX, "%s", label);
+    nodeCount++;
+
+    if (nodeCount * 4 > lookupCapacity * 3)
+    {
+        growLookup();
+    }
+    else
+    {
+        uint32_t slot = hashPointer(object) & (lookupCapacity - 1);
+        while (lookup[slot] != 0) slot = (slot + 1) & (lookupCapacity - 1);
+        lookup[slot] = nodeCount - 1;
+    }
+    return nodeCount - 1;
+}
+
+// 一条边：在根里写R，在对象里写E
+static void edge(Obj* object, const char* label)
+{
+    if (object == NULL) return;
+    int id = nodeId(object, label);
+    fprintf(output, "%c %d %s\n", current == 0 ? 'R' : 'E', id, label);
+}
+
+static void edgeValue(Value value, const char* label)
+{
+    if (IS_OBJ(value)) edge(AS_OBJ(value), label);
+}
+
+// 边的名字里不能有空白，分析工具按空白切分
+static void makeLabel(char* label, const char* prefix, ObjString* name)
+{
+    snprintf(label, LABEL_MAX, "%s%s", prefix, name != NULL ? name->chars : "?");
+    for (char* c = label; *c != '\0'; ++c)
+    {
+        if (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r') *c = '_';
+    }
+}
+
+// 和markTable一样，键和值都是边
+static void edgeTable(Table* table, const char* keyPrefix, const char* valuePrefix)
+{
+    char label[LABEL_MAX];
+    for (int i = 0; i < table->capacity; ++i)
+    {
+        Entry* entry = &table->entries[i];
+        ObjString* key = KEY_STRING(entry->key);
+        if (key == NULL) continue;
+
+        makeLabel(label, keyPrefix, key);
+        edge((Obj*)key, label);
+        makeLabel(label, valuePrefix, key);
+        edgeValue(entry->value, label);
+    }
+}
+
+// 和markRoots一样的根，编译器的根只在编译期间有，这里不会碰上
+static void dumpRoots()
+{
+    char label[LABEL_MAX];
+    for (Value* slot = vm.stack; slot < vm.stackTop; ++slot)
+    {
+        snprintf(label, LABEL_MAX, "stack[%d]", (int)(slot - vm.stack));
+        edgeValue(*slot, label);
+    }
+
+    for (int i = 0; i < vm.frameCount; ++i)
+    {
+        snprintf(label, LABEL_MAX, "frame[%d]", i);
+        edge((Obj*)vm.frames[i].closure, label);
+    }
+
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+    {
+        edge((Obj*)upvalue, "open-upvalue");
+    }
+
+    edgeTable(&vm.globals, "global-name:", "global:");
+    edge((Obj*)vm.initString, "initString");
+}
+
+// 和blackenObject走同样的边
+static void dumpEdges(Obj* object)
+{
+    char label[LABEL_MAX];
+    switch (object->type)
+    {
+        case OBJ_BOUND_METHOD:
+        {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            edgeValue(bound->receiver, "receiver");
+            edge((Obj*)bound->method, "method");
+            break;
+        }
+        case OBJ_INSTANCE:
+        {
+            ObjInstance* instance = (ObjInstance*)object;
+            edge((Obj*)instance->klass, "class");
+            edgeTable(&instance->fields, "field-name:", ".");
+            break;
+        }
+        case OBJ_CLASS:
+        {
+            ObjClass* klass = (ObjClass*)object;
+            edge((Obj*)klass->name, "name");
+            edgeTable(&klass->methods, "method-name:", "method:");
+            break;
+        }
+        case OBJ_CLOSURE:
+        {
+            ObjClosure* closure = (ObjClosure*)object;
+            edge((Obj*)closure->function, "function");
+            for (int i = 0; i < closure->upvalueCount; ++i)
+            {
+                snprintf(label, LABEL_MAX, "upvalue[%d]", i);
+                edge((Obj*)UPVALUE_AT(closure, i), label);
+            }
+            break;
+        }
+        case OBJ_FUNCTION:
+        {
+            ObjFunction* function = (ObjFunction*)object;
+            edge((Obj*)function->name, "name");
+            for (int i = 0; i < function->chunk.constants.count; ++i)
+            {
+                snprintf(label, LABEL_MAX, "constant[%d]", i);
+                edgeValue(function->chunk.constants.values[i], label);
+            }
+            break;
+        }
+        case OBJ_UPVALUE:
+            edgeValue(((ObjUpvalue*)object)->closed, "closed");
+            break;
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+            break;
+    }
+}
+
+// 对象自己的槽加上只归它所有的数组
+static size_t objectSize(Obj* object)
+{
+    switch (object->type)
+    {
+        case OBJ_BOUND_METHOD: return heapSlotSize(sizeof(ObjBoundMethod));
+        case OBJ_NATIVE: return heapSlotSize(sizeof(ObjNative));
+        case OBJ_UPVALUE: return heapSlotSize(sizeof(ObjUpvalue));
+        case OBJ_INSTANCE:
+            return heapSlotSize(sizeof(ObjInstance)) + sizeof(Entry) * ((ObjInstance*)object)->fields.capacity;
+        case OBJ_CLASS:
+            return heapSlotSize(sizeof(ObjClass)) + sizeof(Entry) * ((ObjClass*)object)->methods.capacity;
+        case OBJ_CLOSURE:
+            return heapSlotSize(sizeof(ObjClosure)) + heapSlotSize(sizeof(UpvalueRef) * ((ObjClosure*)object)->upvalueCount);
+        case OBJ_STRING:
+            return heapSlotSize(sizeof(ObjString)) + heapSlotSize(((ObjString*)object)->length + 1);
+        case OBJ_FUNCTION:
+        {
+            Chunk* chunk = &((ObjFunction*)object)->chunk;
+            return heapSlotSize(sizeof(ObjFunction)) + sizeof(uint8_t) * chunk->capacity
+                + sizeof(LineStart) * chunk->lineCapacity + sizeof(Value) * chunk->constants.capacity;
+        }
+    }
+    return 0;
+}
+
+static const char* typeName(ObjType type)
+{
+    switch (type)
+    {
+        case OBJ_BOUND_METHOD: return "bound_method";
+        case OBJ_NATIVE: return "native";
+        case OBJ_INSTANCE: return "instance";
+        case OBJ_CLASS: return "class";
+        case OBJ_FUNCTION: return "function";
+        case OBJ_CLOSURE: return "closure";
+        case OBJ_STRING: return "string";
+        case OBJ_UPVALUE: return "upvalue";
+    }
+    return "?";
+}
+
+static const char* functionName(ObjFunction* function)
+{
+    return function->name != NULL ? function->name->chars : "<script>";
+}
+
+// 一眼能认出是谁：字符串的开头、函数名、类名
+static void writeSummary(Obj* object)
+{
+    switch (object->type)
+    {
+        case OBJ_STRING:
+        {
+            ObjString* string = (ObjString*)object;
+            fputs(" \"", output);
+            for (int i = 0; i < string->length && i < SUMMARY_CHARS; ++i)
+            {
+                char c = string->chars[i];
+                if (c == '"' || c == '\\') fprintf(output, "\\%c", c);
+                else if (c == '\n') fputs("\\n", output);
+                else if ((unsigned char)c < ' ') fputc('?', output);
+                else fputc(c, output);
+            }
+            fputs(string->length > SUMMARY_CHARS ? "...\"" : "\"", output);
+            break;
+        }
+        case OBJ_FUNCTION:
+            fprintf(output, " %s", functionName((ObjFunction*)object));
+            break;
+        case OBJ_CLOSURE:
+            fprintf(output, " %s", functionName(((ObjClosure*)object)->function));
+            break;
+        case OBJ_BOUND_METHOD:
+            fprintf(output, " %s", functionName(((ObjBoundMethod*)object)->method->function));
+            break;
+        case OBJ_CLASS:
+            fprintf(output, " %s", ((ObjClass*)object)->name->chars);
+            break;
+        case OBJ_INSTANCE:
+            fprintf(output, " %s instance", ((ObjInstance*)object)->klass->name->chars);
+            break;
+        case OBJ_NATIVE:
+        case OBJ_UPVALUE:
+            break;
+    }
+}
+
+int dumpHeap(const char* path)
+{
+    output = fopen(path, "w");
+    if (output == NULL) return -1;
+
+    fprintf(output, "lox-heap-snapshot 1\n");
+
+    nodeCapacity = 1024;
+    nodes = allocate(sizeof(Node) * nodeCapacity);
+    nodeCount = 1;              // 0号是根
+    current = 0;
+    dumpRoots();
+
+    for (current = 1; current < nodeCount; ++current)
+    {
+        Node* node = &nodes[current];
+        Obj* object = node->object;
+        fprintf(output, "O %d %s %zu %d %s", current, typeName(object->type), objectSize(object), node->parent,
+            node->label);
+        writeSummary(object);
+        fputc('\n', output);
+        dumpEdges(object);      // 可能扩容，node之后不能再用
+    }
+
+    fclose(output);
+    output = NULL;
+
+    int objects = nodeCount - 1;
+    free(nodes);
+    free(lookup);
+    nodes = NULL;
+    lookup = NULL;
+    nodeCount = nodeCapacity = lookupCapacity = 0;
+    return objects;
+}
@@ -0,0 +1,810 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flight.h"
+#include "image.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+Image image;
+
+// 按这个顺序写对象，读的时候构造一个对象要用到的（闭包的函数、实例的类、名字）都已经建好了
+static const ObjType typeOrder[] = {
+    OBJ_STRING, OBJ_NATIVE, OBJ_FUNCTION, OBJ_CLASS, OBJ_CLOSURE, OBJ_UPVALUE, OBJ_INSTANCE, OBJ_BOUND_METHOD,
+};
+
+// 写镜像时攒内容
+typedef struct
+{
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+} Writer;
+
+// 读镜像：越界、编号不对就置failed，之后读出来的全是0
+typedef struct
+{
+    const uint8_t* data;
+    size_t size;
+    size_t position;
+    bool failed;
+} Reader;
+
+// 写：走到的对象和它们的编号
+static Obj** found = NULL;
+static uint32_t foundCount = 0;
+static uint32_t foundCapacity = 0;
+static uint32_t* lookup = NULL;         // 对象地址 -> found里的下标+1，开放寻址
+static uint32_t lookupCapacity = 0;
+static bool saveFailed = false;
+
+// 读：编号 -> 对象，已经建好的前restoredCount个是GC的根
+static Obj** restored = NULL;
+static uint32_t restoredCount = 0;
+
+bool imageOption(const char* arg)
+{
+    if (strncmp(arg, "--image=", 8) == 0 && arg[8] != '\0')
+    {
+        image.loadPath = arg + 8;
+        return true;
+    }
+    if (strncmp(arg, "--save-image=", 13) == 0 && arg[13] != '\0')
+    {
+        image.savePath = arg + 13;
+        return true;
+    }
+    return false;
+}
+
+static void* allocate(size_t size)
+{
+    void* result = calloc(1, size > 0 ? size : 1);
+    if (result == NULL)
+    {
+        fprintf(stderr, "Not enough memory for the heap image.\n");
+        exit(1);
+    }
+    return result;
+}
+
+// FNV-1a，64位
+static uint64_t hashBytes(const void* data, size_t size)
+{
+    const uint8_t* bytes = data;
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static uint32_t hashPointer(Obj* pointer)
+{
+    uint64_t bits = (uint64_t)(uintptr_t)pointer;
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+static void insertLookup(Obj* object, uint32_t index)
+{
+    uint32_t slot = hashPointer(object) & (lookupCapacity - 1);
+    while (lookup[slot] != 0) slot = (slot + 1) & (lookupCapacity - 1);
+    lookup[slot] = index + 1;
+}
+
+static void rebuildLookup()
+{
+    free(lookup);
+    while (foundCount * 4 >= lookupCapacity * 3) lookupCapacity = lookupCapacity < 1024 ? 1024 : lookupCapacity * 2;
+    lookup = allocate(sizeof(uint32_t) * lookupCapacity);
+    for (uint32_t i = 0; i < foundCount; ++i) insertLookup(found[i], i);
+}
+
+// 对象在found里的下标+1，没走到过是0
+static uint32_t objectId(Obj* object)
+{
+    if (lookupCapacity == 0) return 0;
+    uint32_t slot = hashPointer(object) & (lookupCapacity - 1);
+    while (lookup[slot] != 0)
+    {
+        if (found[lookup[slot] - 1] == object) return lookup[slot];
+        slot = (slot + 1) & (lookupCapacity - 1);
+    }
+    return 0;
+}
+
+// 第一次走到就排进队列，found本身就是广度优先的队列
+static void discover(Obj* object)
+{
+    if (object == NULL || objectId(object) != 0) return;
+    if (foundCount + 1 > foundCapacity)
+    {
+        foundCapacity = foundCapacity < 1024 ? 1024 : foundCapacity * 2;
+        found = realloc(found, sizeof(Obj*) * foundCapacity);
+        if (found == NULL)
+        {
+            fprintf(stderr, "Not enough memory for the heap image.\n");
+            exit(1);
+        }
+    }
+    found[foundCount++] = object;
+    if (foundCount * 4 >= lookupCapacity * 3) rebuildLookup();
+    else insertLookup(object, foundCount - 1);
+}
+
+static void discoverValue(Value value)
+{
+    if (IS_OBJ(value)) discover(AS_OBJ(value));
+}
+
+static void discoverTable(Table* table)
+{
+    for (int i = 0; i < table->capacity; ++i)
+    {
+        Entry* entry = &table->entries[i];
+        if (entry->key == NO_KEY) continue;
+        discover((Obj*)KEY_STRING(entry->key));
+        discoverValue(entry->value);
+    }
+}
+
+// 和blackenObject走一样的边
+static void discoverReferences(Obj* object)
+{
+    switch (object->type)
+    {
+        case OBJ_BOUND_METHOD:
+        {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            discoverValue(bound->receiver);
+            discover((Obj*)bound->method);
+            break;
+        }
+        case OBJ_CLASS:
+        {
+            ObjClass* klass = (ObjClass*)object;
+            discover((Obj*)klass->name);
+            discoverTable(&klass->methods);
+            break;
+        }
+        case OBJ_INSTANCE:
+        {
+            ObjInstance* instance = (ObjInstance*)object;
+            discover((Obj*)instance->klass);
+            discoverTable(&instance->fields);
+            break;
+        }
+        case OBJ_CLOSURE:
+        {
+            ObjClosure* closure = (ObjClosure*)object;
+            discover((Obj*)closure->function);
+            for (int i = 0; i < closure->upvalueCount; ++i)
+            {
+                discover((Obj*)UPVALUE_AT(closure, i));
+            }
+            break;
+        }
+        case OBJ_FUNCTION:
+        {
+            ObjFunction* function = (ObjFunction*)object;
+            discover((Obj*)function->name);
+            for (int i = 0; i < function->chunk.constants.count; ++i)
+            {
+                discoverValue(function->chunk.constants.values[i]);
+            }
+            break;
+        }
+        case OBJ_UPVALUE:
+        {
+            ObjUpvalue* upvalue = (ObjUpvalue*)object;
+            if (upvalue->location != &upvalue->closed) saveFailed = true;   // 还指着栈
+            discoverValue(upvalue->closed);
+            break;
+        }
+        case OBJ_NATIVE:
+            if (nativeName(((ObjNative*)object)->function) == NULL) saveFailed = true;
+            break;
+        case OBJ_STRING:
+            break;
+    }
+}
+
+// 函数按后序排：常量池里嵌套的函数先建，读的时候外层函数的常量直接就能填上
+static void orderFunction(ObjFunction* function, Obj** order, uint32_t* count, bool* placed)
+{
+    uint32_t index = objectId((Obj*)function) - 1;
+    if (placed[index]) return;
+    placed[index] = true;
+    for (int i = 0; i < function->chunk.constants.count; ++i)
+    {
+        Value value = function->chunk.constants.values[i];
+        if (IS_FUNCTION(value)) orderFunction(AS_FUNCTION(value), order, count, placed);
+    }
+    order[(*count)++] = (Obj*)function;
+}
+
+static void writeBytes(Writer* writer, const void* data, size_t size)
+{
+    if (writer->size + size > writer->capacity)
+    {
+        size_t capacity = writer->capacity < 4096 ? 4096 : writer->capacity;
+        while (capacity < writer->size + size) capacity *= 2;
+        writer->data = realloc(writer->data, capacity);
+        if (writer->data == NULL)
+        {
+            fprintf(stderr, "Not enough memory for the heap image.\n");
+            exit(1);
+        }
+        writer->capacity = capacity;
+    }
+    memcpy(writer->data + writer->size, data, size);
+    writer->size += size;
+}
+
+static void writeInt(Writer* writer, uint32_t value)
+{
+    writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeByte(Writer* writer, uint8_t value)
+{
+    writeBytes(writer, &value, 1);
+}
+
+// 引用写编号，NULL写0
+static void writeRef(Writer* writer, Obj* object)
+{
+    writeInt(writer, object != NULL ? objectId(object) : 0);
+}
+
+static void writeValue(Writer* writer, Value value)
+{
+    if (IS_NIL(value))
+    {
+        writeByte(writer, IMAGE_NIL);
+    }
+    else if (IS_BOOL(value))
+    {
+        writeByte(writer, AS_BOOL(value) ? IMAGE_TRUE : IMAGE_FALSE);
+    }
+    else if (IS_NUMBER(value))
+    {
+        double number = AS_NUMBER(value);
+        writeByte(writer, IMAGE_NUMBER);
+        writeBytes(writer, &number, sizeof(number));
+    }
+    else
+    {
+        writeByte(writer, IMAGE_OBJECT);
+        writeRef(writer, AS_OBJ(value));
+    }
+}
+
+static void writeTable(Writer* writer, Table* table)
+{
+    uint32_t count = 0;
+    for (int i = 0; i < table->capacity; ++i)
+    {
+        if (table->entries[i].key != NO_KEY) count++;
+    }
+    writeInt(writer, count);
+    for (int i = 0; i < table->capacity; ++i)
+    {
+        Entry* entry = &table->entries[i];
+        if (entry->key == NO_KEY) continue;
+        writeRef(writer, (Obj*)KEY_STRING(entry->key));
+        writeValue(writer, entry->value);
+    }
+}
+
+static void writeChars(Writer* writer, const char* chars, int length)
+{
+    writeInt(writer, (uint32_t)length);
+    writeBytes(writer, chars, length);
+}
+
+static void writeObject(Writer* writer, Obj* object)
+{
+    writeByte(writer, (uint8_t)object->type);
+    switch (object->type)
+    {
+        case OBJ_STRING:
+        {
+            ObjString* string = (ObjString*)object;
+            writeChars(writer, string->chars, string->length);
+            break;
+        }
+        case OBJ_NATIVE:
+        {
+            const char* name = nativeName(((ObjNative*)object)->function);
+            writeChars(writer, name, (int)strlen(name));
+            break;
+        }
+        case OBJ_FUNCTION:
+        {
+            ObjFunction* function = (ObjFunction*)object;
+            Chunk* chunk = &function->chunk;
+            writeInt(writer, (uint32_t)function->arity);
+            writeInt(writer, (uint32_t)function->upvalueCount);
+            writeRef(writer, (Obj*)function->name);
+            writeInt(writer, (uint32_t)chunk->count);
+            writeBytes(writer, chunk->code, chunk->count);
+            writeInt(writer, (uint32_t)chunk->lineCount);
+            writeBytes(writer, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+            writeInt(writer, (uint32_t)chunk->constants.count);
+            for (int i = 0; i < chunk->constants.count; ++i)
+            {
+                writeValue(writer, chunk->constants.values[i]);
+            }
+            break;
+        }
+        case OBJ_CLASS:
+        {
+            ObjClass* klass = (ObjClass*)object;
+            writeRef(writer, (Obj*)klass->name);
+            writeTable(writer, &klass->methods);
+            break;
+        }
+        case OBJ_CLOSURE:
+        {
+            ObjClosure* closure = (ObjClosure*)object;
+            writeRef(writer, (Obj*)closure->function);
+            writeInt(writer, (uint32_t)closure->upvalueCount);
+            for (int i = 0; i < closure->upvalueCount; ++i)
+            {
+                writeRef(writer, (Obj*)UPVALUE_AT(closure, i));
+            }
+            break;
+        }
+        case OBJ_UPVALUE:
+            writeValue(writer, ((ObjUpvalue*)object)->closed);
+            break;
+        case OBJ_INSTANCE:
+        {
+            ObjInstance* instance = (ObjInstance*)object;
+            writeRef(writer, (Obj*)instance->klass);
+            writeTable(writer, &instance->fields);
+            break;
+        }
+        case OBJ_BOUND_METHOD:
+        {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            writeRef(writer, (Obj*)bound->method);
+            writeValue(writer, bound->receiver);
+            break;
+        }
+    }
+}
+
+static void resetSave()
+{
+    free(found);
+    free(lookup);
+    found = NULL;
+    lookup = NULL;
+    foundCount = foundCapacity = lookupCapacity = 0;
+    saveFailed = false;
+}
+
+int saveImage(const char* path)
+{
+    // 从全局变量出发走一遍，走到的对象就是镜像里的全部对象
+    discoverTable(&vm.globals);
+    for (uint32_t i = 0; i < foundCount && !saveFailed; ++i)
+    {
+        discoverReferences(found[i]);
+    }
+    if (saveFailed || vm.frameCount > 0)
+    {
+        resetSave();
+        return -1;
+    }
+
+    // 按类型排好，编号就是排好以后的位置
+    Obj** order = allocate(sizeof(Obj*) * (foundCount > 0 ? foundCount : 1));
+    bool* placed = allocate(foundCount > 0 ? foundCount : 1);
+    uint32_t count = 0;
+    for (size_t type = 0; type < sizeof(typeOrder) / sizeof(typeOrder[0]); ++type)
+    {
+        for (uint32_t i = 0; i < foundCount; ++i)
+        {
+            if (found[i]->type != typeOrder[type]) continue;
+            if (found[i]->type == OBJ_FUNCTION) orderFunction((ObjFunction*)found[i], order, &count, placed);
+            else order[count++] = found[i];
+        }
+    }
+    free(placed);
+    memcpy(found, order, sizeof(Obj*) * foundCount);
+    free(order);
+    rebuildLookup();
+
+    Writer writer = { NULL, 0, 0 };
+    for (uint32_t i = 0; i < foundCount; ++i)
+    {
+        writeObject(&writer, found[i]);
+    }
+    writeTable(&writer, &vm.globals);
+
+    ImageHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    header.version = IMAGE_VERSION;
+    header.objectCount = foundCount;
+    header.payloadSize = writer.size;
+    header.payloadHash = hashBytes(writer.data, writer.size);
+
+    int result = (int)foundCount;
+    FILE* file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        result = -1;
+    }
+    else
+    {
+        if (fwrite(&header, sizeof(header), 1, file) != 1 || fwrite(writer.data, 1, writer.size, file) != writer.size)
+        {
+            result = -1;
+        }
+        if (fclose(file) != 0) result = -1;
+    }
+    free(writer.data);
+    resetSave();
+    return result;
+}
+
+static void readBytes(Reader* reader, void* out, size_t size)
+{
+    if (reader->failed || size > reader->size - reader->position)
+    {
+        reader->failed = true;
+        memset(out, 0, size);
+        return;
+    }
+    memcpy(out, reader->data + reader->position, size);
+    reader->position += size;
+}
+
+static uint32_t readInt(Reader* reader)
+{
+    uint32_t value;
+    readBytes(reader, &value, sizeof(value));
+    return value;
+}
+
+static uint8_t readByte(Reader* reader)
+{
+    uint8_t value;
+    readBytes(reader, &value, 1);
+    return value;
+}
+
+// 定长的数组，先确认剩下的字节够，坏文件里的长度不会让我们申请一大块
+static bool fits(Reader* reader, uint64_t count, size_t size)
+{
+    if (reader->failed || count > (reader->size - reader->position) / size) reader->failed = true;
+    return !reader->failed;
+}
+
+// 编号换回对象：只能引用已经建好的（limit以内），类型给了就要对上；0是NULL
+static Obj* readRef(Reader* reader, uint32_t limit, int type)
+{
+    uint32_t id = readInt(reader);
+    if (reader->failed || id == 0) return NULL;
+    if (id > limit || (type >= 0 && restored[id]->type != (ObjType)type))
+    {
+        reader->failed = true;
+        return NULL;
+    }
+    return restored[id];
+}
+
+// 读一个值；只是跳过的话不查编号
+static Value readValue(Reader* reader, uint32_t limit, bool skip)
+{
+    switch (readByte(reader))
+    {
+        case IMAGE_NIL: return NIL_VAL;
+        case IMAGE_FALSE: return BOOL_VAL(false);
+        case IMAGE_TRUE: return BOOL_VAL(true);
+        case IMAGE_NUMBER:
+        {
+            double number;
+            readBytes(reader, &number, sizeof(number));
+            return compactNumber(number);     // 整数还原成小整数，和编译、运算出来的一样
+        }
+        case IMAGE_OBJECT:
+        {
+            if (skip)
+            {
+                readInt(reader);
+                return NIL_VAL;
+            }
+            Obj* object = readRef(reader, limit, -1);
+            if (object == NULL) reader->failed = true;
+            return reader->failed ? NIL_VAL : OBJ_VAL(object);
+        }
+        default:
+            reader->failed = true;
+            return NIL_VAL;
+    }
+}
+
+static ObjString* readChars(Reader* reader)
+{
+    uint32_t length = readInt(reader);
+    if (!fits(reader, length, 1)) return NULL;
+    ObjString* string = copyString((const char*)reader->data + reader->position, (int)length);
+    reader->position += length;
+    return string;
+}
+
+// 表要等所有对象都建好才能填，patch为false时只跳过
+static void readTable(Reader* reader, Table* table, uint32_t limit, bool patch)
+{
+    uint32_t count = readInt(reader);
+    for (uint32_t i = 0; i < count && !reader->failed; ++i)
+    {
+        if (!patch)
+        {
+            readInt(reader);
+            readValue(reader, limit, true);
+            continue;
+        }
+        ObjString* key = (ObjString*)readRef(reader, limit, OBJ_STRING);
+        Value value = readValue(reader, limit, false);
+        if (key == NULL) reader->failed = true;
+        if (!reader->failed) tableSet(table, key, value);
+    }
+}
+
+static ObjFunction* readFunction(Reader* reader, uint32_t limit)
+{
+    ObjFunction* function = newFunction();
+    restored[limit + 1] = (Obj*)function;   // 先当根占住位置，填常量时可能GC
+    restoredCount = limit + 1;
+
+    uint32_t arity = readInt(reader);
+    uint32_t upvalueCount = readInt(reader);
+    if (arity > 255 || upvalueCount > UINT8_COUNT) reader->failed = true;
+    function->arity = (int)arity;
+    function->upvalueCount = reader->failed ? 0 : (int)upvalueCount;
+    function->name = (ObjString*)readRef(reader, limit, OBJ_STRING);
+
+    Chunk* chunk = &function->chunk;
+    uint32_t count = readInt(reader);
+    if (count == 0 || !fits(reader, count, 1))
+    {
+        reader->failed = true;
+        return function;
+    }
+    chunk->code = GROW_APPLY(uint8_t, NULL, 0, count);
+    chunk->capacity = (int)count;
+    readBytes(reader, chunk->code, count);
+    chunk->count = (int)count;
+
+    uint32_t lineCount = readInt(reader);
+    if (lineCount == 0 || !fits(reader, lineCount, sizeof(LineStart)))
+    {
+        reader->failed = true;
+        return function;
+    }
+    chunk->lines = GROW_APPLY(LineStart, NULL, 0, lineCount);
+    chunk->lineCapacity = (int)lineCount;
+    readBytes(reader, chunk->lines, sizeof(LineStart) * lineCount);
+    chunk->lineCount = (int)lineCount;
+
+    uint32_t constants = readInt(reader);
+    if (constants > UINT8_COUNT) reader->failed = true;
+    for (uint32_t i = 0; i < constants && !reader->failed; ++i)
+    {
+        Value value = readValue(reader, limit, false);
+        if (!reader->failed) addConstant(chunk, value);
+    }
+    if (!reader->failed && !verifyChunk(chunk)) reader->failed = true;
+    if (!reader->failed && flight.enabled) flightRegister(function);
+    return function;
+}
+
+// 第一遍：id号对象建出来，引用里只填构造时要用的，它们的编号一定更小
+static Obj* createObject(Reader* reader, uint32_t id)
+{
+    uint32_t limit = id - 1;
+    ObjType type = (ObjType)readByte(reader);
+    switch (type)
+    {
+        case OBJ_STRING:
+            return (Obj*)readChars(reader);
+        case OBJ_NATIVE:
+        {
+            // 新虚拟机里同名的那个本地函数，比较时还是同一个对象
+            ObjString* name = readChars(reader);
+            Value native;
+            if (name == NULL || !tableGet(&vm.globals, name, &native) || !IS_NATIVE(native))
+            {
+                reader->failed = true;
+                return NULL;
+            }
+            return AS_OBJ(native);
+        }
+        case OBJ_FUNCTION:
+            return (Obj*)readFunction(reader, limit);
+        case OBJ_CLASS:
+        {
+            ObjString* name = (ObjString*)readRef(reader, limit, OBJ_STRING);
+            readTable(reader, NULL, limit, false);
+            if (name == NULL) reader->failed = true;
+            return reader->failed ? NULL : (Obj*)newClass(name);
+        }
+        case OBJ_CLOSURE:
+        {
+            ObjFunction* function = (ObjFunction*)readRef(reader, limit, OBJ_FUNCTION);
+            uint32_t upvalueCount = readInt(reader);
+            if (function == NULL || upvalueCount != (uint32_t)function->upvalueCount || !fits(reader, upvalueCount, 4))
+            {
+                reader->failed = true;
+                return NULL;
+            }
+            reader->position += sizeof(uint32_t) * upvalueCount;
+            return (Obj*)newClosure(function);
+        }
+        case OBJ_UPVALUE:
+        {
+            readValue(reader, limit, true);
+            ObjUpvalue* upvalue = newUpvalue(NULL);
+            upvalue->location = &upvalue->closed;
+            return (Obj*)upvalue;
+        }
+        case OBJ_INSTANCE:
+        {
+            ObjClass* klass = (ObjClass*)readRef(reader, limit, OBJ_CLASS);
+            readTable(reader, NULL, limit, false);
+            if (klass == NULL) reader->failed = true;
+            return reader->failed ? NULL : (Obj*)newInstance(klass);
+        }
+        case OBJ_BOUND_METHOD:
+        {
+            ObjClosure* method = (ObjClosure*)readRef(reader, limit, OBJ_CLOSURE);
+            readValue(reader, limit, true);
+            if (method == NULL) reader->failed = true;
+            return reader->failed ? NULL : (Obj*)newBoundMethod(NIL_VAL, method);
+        }
+    }
+    reader->failed = true;
+    return NULL;
+}
+
+// 第二遍：所有对象都在了，把剩下的引用填上
+static void patchObject(Reader* reader, uint32_t id, uint32_t limit)
+{
+    Obj* object = restored[id];
+    readByte(reader);
+    switch (object->type)
+    {
+        case OBJ_STRING:
+        case OBJ_NATIVE:
+        {
+            uint32_t length = readInt(reader);
+            if (fits(reader, length, 1)) reader->position += length;
+            break;
+        }
+        case OBJ_FUNCTION:
+        {
+            Chunk* chunk = &((ObjFunction*)object)->chunk;
+            readInt(reader);
+            readInt(reader);
+            readInt(reader);
+            reader->position += 4 + chunk->count;
+            reader->position += 4 + sizeof(LineStart) * chunk->lineCount;
+            uint32_t constants = readInt(reader);
+            for (uint32_t i = 0; i < constants && !reader->failed; ++i)
+            {
+                readValue(reader, limit, true);
+            }
+            break;
+        }
+        case OBJ_CLASS:
+            readInt(reader);
+            readTable(reader, &((ObjClass*)object)->methods, limit, true);
+            break;
+        case OBJ_CLOSURE:
+        {
+            ObjClosure* closure = (ObjClosure*)object;
+            readInt(reader);
+            readInt(reader);
+            for (int i = 0; i < closure->upvalueCount && !reader->failed; ++i)
+            {
+                ObjUpvalue* upvalue = (ObjUpvalue*)readRef(reader, limit, OBJ_UPVALUE);
+                if (upvalue == NULL) reader->failed = true;
+                else closure->upvalues[i] = UPVALUE_REF(upvalue);
+            }
+            break;
+        }
+        case OBJ_UPVALUE:
+            ((ObjUpvalue*)object)->closed = readValue(reader, limit, false);
+            break;
+        case OBJ_INSTANCE:
+            readInt(reader);
+            readTable(reader, &((ObjInstance*)object)->fields, limit, true);
+            break;
+        case OBJ_BOUND_METHOD:
+            readInt(reader);
+            ((ObjBoundMethod*)object)->receiver = readValue(reader, limit, false);
+            break;
+    }
+}
+
+static bool restore(Reader* reader, uint32_t objectCount)
+{
+    for (uint32_t id = 1; id <= objectCount && !reader->failed; ++id)
+    {
+        Obj* object = createObject(reader, id);
+        if (object == NULL) reader->failed = true;
+        restored[id] = object;
+        restoredCount = id;
+    }
+
+    size_t globals = reader->position;
+    reader->position = 0;
+    for (uint32_t id = 1; id <= objectCount && !reader->failed; ++id)
+    {
+        patchObject(reader, id, objectCount);
+    }
+    if (reader->failed || reader->position != globals) return false;
+
+    // 对象都好了才动全局变量，读到一半失败的话虚拟机还是干净的，建了一半的对象下次GC收掉
+    size_t start = reader->position;
+    readTable(reader, NULL, objectCount, false);
+    if (reader->failed || reader->position != reader->size) return false;
+    reader->position = start;
+    readTable(reader, &vm.globals, objectCount, true);
+    return !reader->failed;
+}
+
+bool loadImage(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not open image \"%s\".\n", path);
+        return false;
+    }
+
+    ImageHeader header;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1
+        && memcmp(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) == 0 && header.version == IMAGE_VERSION
+        && header.payloadSize < ((uint64_t)1 << 40) && header.objectCount <= header.payloadSize;
+    uint8_t* payload = valid ? malloc(header.payloadSize > 0 ? header.payloadSize : 1) : NULL;
+    valid = payload != NULL && fread(payload, 1, header.payloadSize, file) == header.payloadSize
+        && fgetc(file) == EOF && hashBytes(payload, header.payloadSize) == header.payloadHash;
+    fclose(file);
+
+    if (valid)
+    {
+        restored = allocate(sizeof(Obj*) * ((size_t)header.objectCount + 1));
+        restoredCount = 0;
+        Reader reader = { payload, header.payloadSize, 0, false };
+        valid = restore(&reader, header.objectCount);
+        free(restored);
+        restored = NULL;
+        restoredCount = 0;
+    }
+    free(payload);
+
+    if (!valid) fprintf(stderr, "\"%s\" is not a valid clox image.\n", path);
+    return valid;
+}
+
+void markImageRoots()
+{
+    for (uint32_t id = 1; id <= restoredCount; ++id)
+    {
+        markObject(restored[id]);
+    }
+}
@@ -3,8 +3,18 @@
 #include <string.h>
 
 #include "common.h"
+#include "allocprof.h"
+#include "bytecache.h"
+#include "codearena.h"
 #include "chunk.h"
+#include "coverage.h"
 #include "debug.h"
+#include "flight.h"
+#include "gc.h"
+#include "heapdump.h"
+#include "image.h"
+#include "opstats.h"
+#include "profiler.h"
 #include "vm.h"
 
 // 命令行
@@ -63,6 +73,7 @@ static char* readFile(const char* path)
 static void runFile(const char* path)
 {
     char* source = readFile(path);
+    if (coverage.enabled) coverageSource(source);
     InterpretResult result = interpret(source);
     free(source);
 
@@ -70,22 +81,81 @@ static void runFile(const char* path)
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+static void usage()
+{
+    fprintf(stderr, "Usage: clox [options] [path]\n"
+        "  --gc-initial-heap=SIZE   first collection threshold (K/M/G suffix)\n"
+        "  --gc-grow-factor=F       next threshold = live bytes * F\n"
+        "  --gc-max-heap=SIZE       heap ceiling, exceeding it is an out-of-memory runtime error\n"
+        "  --gc-target-pause=MS     shrink the growth factor when pauses exceed MS\n"
+        "  --gc-stats=PATH          write one telemetry line per collection\n"
+        "  --gc-log                 print every collection step\n"
+        "  --disassemble            print the bytecode of each compiled function\n"
+        "  --trace                  print the stack and each instruction as it runs\n"
+        "  --profile=PATH           sample the running script, write folded stacks for flamegraph tools\n"
+        "  --profile-hz=N           sampling rate, default 1000\n"
+        "  --opcode-stats           count executed opcodes and hot property/invoke sites, print at exit\n"
+        "  --opcode-cycles          like --opcode-stats, also time each opcode with the cycle counter\n"
+        "  --coverage=PATH          count executed instructions per source line, write an annotated listing\n"
+        "  --alloc-profile=PATH     count allocations by object type and source line, write a report at exit\n"
+        "  --heap-dump=PATH         write a heap snapshot on SIGUSR1 (later dumps go to PATH.2, PATH.3, ...)\n"
+        "  --flight=PATH            keep recent calls, GCs and errors in a ring buffer, dump it on a crash\n"
+        "  --flight-sample=N        also record every Nth instruction\n"
+        "  --cache-dir=DIR          keep compiled bytecode in DIR, keyed by a hash of the source\n"
+        "  --code-layout=PROFILE    place the functions hottest in a --profile output next to each other\n"
+        "  --image=PATH             load a heap image before running\n"
+        "  --save-image=PATH        after the script finishes, write everything reachable from globals to an image\n"
+        "Each option can also be set with LOX_GC_INITIAL_HEAP, LOX_GC_GROW_FACTOR, ...\n");
+    exit(64);
+}
+
 int main(int argc, const char* argv[])
 {
+    gcPolicyFromEnv();  // 命令行覆盖环境变量
+
+    const char* path = NULL;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strncmp(argv[i], "--", 2) == 0)
+        {
+            if (!debugOption(argv[i]) && !gcPolicyOption(argv[i]) && !profilerOption(argv[i])
+                && !opstatsOption(argv[i]) && !coverageOption(argv[i])
+                && !allocProfileOption(argv[i]) && !heapDumpOption(argv[i])
+                && !flightOption(argv[i]) && !codeArenaOption(argv[i]) && !byteCacheOption(argv[i])
+                && !imageOption(argv[i]))
+            {
+                fprintf(stderr, "Invalid option \"%s\".\n", argv[i]);
+                usage();
+            }
+        }
+        else if (path == NULL)
+        {
+            path = argv[i];
+        }
+        else
+        {
+            usage();
+        }
+    }
+
     initVM();
-    
-    if (argc == 1)
+    startProfiler();
+    if (image.loadPath != NULL && !loadImage(image.loadPath)) exit(74);
+
+    if (path == NULL)
     {
+        byteCache.dir = NULL;   // REPL一行一行编译，不缓存
         repl();
     }
-    else if (argc == 2)
+    else
     {
-        runFile(argv[1]);
+        runFile(path);
     }
-    else
+
+    if (image.savePath != NULL && saveImage(image.savePath) < 0)
     {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        fprintf(stderr, "Could not write image \"%s\".\n", image.savePath);
+        exit(74);
     }
 
     freeVM();
@@ -0,0 +1,293 @@
+#include "marker.h"
+
+#ifdef GC_PARALLEL_MARK
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#define DEQUE_INITIAL_CAPACITY  1024
+
+// 双端队列的环形缓冲区，扩容后旧的挂在新的上面，小偷可能还在读，等这一轮标记结束再释放
+typedef struct GrayBuffer
+{
+    int64_t capacity;
+    struct GrayBuffer* retired;
+    _Atomic(Obj*) items[];
+} GrayBuffer;
+
+// Chase-Lev 工作窃取队列：主人在bottom端压入弹出，小偷从top端偷
+typedef struct
+{
+    _Alignas(64) atomic_int_fast64_t top;
+    _Alignas(64) atomic_int_fast64_t bottom;
+    _Atomic(GrayBuffer*) buffer;
+} GrayDeque;
+
+static GrayDeque deques[GC_MARK_THREADS_MAX];
+static pthread_t workers[GC_MARK_THREADS_MAX];
+static int workerCount = 0;                 // 0表示线程池还没启动，包括主线程在内
+
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolStart = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t poolDone = PTHREAD_COND_INITIALIZER;
+static unsigned long generation = 0;        // 每轮标记加一，唤醒工人
+static int running = 0;                     // 这一轮还没干完的工人
+static bool shutdown = false;
+
+static void (*blackenObject)(Obj*);
+static atomic_int activeWorkers;            // 手里有活或者正在偷的线程数，归零即标记结束
+
+static _Thread_local GrayDeque* localDeque = NULL;
+
+static GrayBuffer* newBuffer(int64_t capacity)
+{
+    GrayBuffer* buffer = (GrayBuffer*)malloc(sizeof(GrayBuffer) + sizeof(_Atomic(Obj*)) * capacity);  // 和灰色栈一样不能走reallocate
+    if (buffer == NULL) exit(1);
+    buffer->capacity = capacity;
+    buffer->retired = NULL;
+    return buffer;
+}
+
+// 只有主人会扩容
+static GrayBuffer* growBuffer(GrayDeque* deque, GrayBuffer* old, int64_t top, int64_t bottom)
+{
+    GrayBuffer* buffer = newBuffer(old->capacity * 2);
+    for (int64_t i = top; i < bottom; ++i)
+    {
+        Obj* object = atomic_load_explicit(&old->items[i & (old->capacity - 1)], memory_order_relaxed);
+        atomic_store_explicit(&buffer->items[i & (buffer->capacity - 1)], object, memory_order_relaxed);
+    }
+    buffer->retired = old;
+    atomic_store_explicit(&deque->buffer, buffer, memory_order_release);
+    return buffer;
+}
+
+static void dequePush(GrayDeque* deque, Obj* object)
+{
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    GrayBuffer* buffer = atomic_load_explicit(&deque->buffer, memory_order_relaxed);
+
+    if (bottom - top > buffer->capacity - 1)
+    {
+        buffer = growBuffer(deque, buffer, top, bottom);
+    }
+
+    atomic_store_explicit(&buffer->items[bottom & (buffer->capacity - 1)], object, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+static Obj* dequePop(GrayDeque* deque)
+{
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    GrayBuffer* buffer = atomic_load_explicit(&deque->buffer, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom)   // 空的
+    {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    Obj* object = atomic_load_explicit(&buffer->items[bottom & (buffer->capacity - 1)], memory_order_relaxed);
+    if (top == bottom)  // 最后一个，和小偷抢
+    {
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                memory_order_seq_cst, memory_order_relaxed))
+        {
+            object = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return object;
+}
+
+static Obj* dequeSteal(GrayDeque* deque)
+{
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) return NULL;
+
+    GrayBuffer* buffer = atomic_load_explicit(&deque->buffer, memory_order_acquire);
+    Obj* object = atomic_load_explicit(&buffer->items[top & (buffer->capacity - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+            memory_order_seq_cst, memory_order_relaxed))
+    {
+        return NULL;    // 被别人抢先了
+    }
+    return object;
+}
+
+static bool dequeLooksEmpty(GrayDeque* deque)
+{
+    return atomic_load_explicit(&deque->top, memory_order_relaxed) >=
+        atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+}
+
+// 一个工人的标记循环：先清空自己的队列，再去偷，所有人都闲下来就结束
+static void drain(int self)
+{
+    GrayDeque* own = &deques[self];
+    for (;;)
+    {
+        Obj* object;
+        while ((object = dequePop(own)) != NULL)
+        {
+            blackenObject(object);
+        }
+
+        // 自己的队列空了，只有自己会往里压，所以之后一直是空的
+        atomic_fetch_sub(&activeWorkers, 1);
+        for (;;)
+        {
+            if (atomic_load(&activeWorkers) == 0) return;
+
+            object = NULL;
+            for (int i = 1; i < workerCount && object == NULL; ++i)
+            {
+                GrayDeque* victim = &deques[(self + i) % workerCount];
+                if (dequeLooksEmpty(victim)) continue;
+
+                atomic_fetch_add(&activeWorkers, 1);    // 先报到再偷，保证计数归零时没有人手里有活
+                object = dequeSteal(victim);
+                if (object == NULL) atomic_fetch_sub(&activeWorkers, 1);
+            }
+
+            if (object != NULL)
+            {
+                blackenObject(object);
+                break;
+            }
+            sched_yield();
+        }
+    }
+}
+
+static void* workerMain(void* arg)
+{
+    int self = (int)(intptr_t)arg;
+    localDeque = &deques[self];
+
+    unsigned long seen = 0;
+    pthread_mutex_lock(&poolMutex);
+    for (;;)
+    {
+        while (generation == seen && !shutdown)
+        {
+            pthread_cond_wait(&poolStart, &poolMutex);
+        }
+        if (shutdown) break;
+        seen = generation;
+        pthread_mutex_unlock(&poolMutex);
+
+        drain(self);
+
+        pthread_mutex_lock(&poolMutex);
+        if (--running == 0) pthread_cond_signal(&poolDone);
+    }
+    pthread_mutex_unlock(&poolMutex);
+    return NULL;
+}
+
+// 第一次标记时启动线程池，线程数可以用环境变量LOX_GC_THREADS覆盖
+static void initMarkers()
+{
+    workerCount = GC_MARK_THREADS;
+    const char* env = getenv("LOX_GC_THREADS");
+    if (env != NULL) workerCount = atoi(env);
+    if (workerCount < 1) workerCount = 1;
+    if (workerCount > GC_MARK_THREADS_MAX) workerCount = GC_MARK_THREADS_MAX;
+
+    for (int i = 0; i < workerCount; ++i)
+    {
+        atomic_init(&deques[i].top, 0);
+        atomic_init(&deques[i].bottom, 0);
+        atomic_init(&deques[i].buffer, newBuffer(DEQUE_INITIAL_CAPACITY));
+    }
+
+    localDeque = &deques[0];    // 主线程就是0号工人
+    for (int i = 1; i < workerCount; ++i)
+    {
+        if (pthread_create(&workers[i], NULL, workerMain, (void*)(intptr_t)i) != 0) exit(1);
+    }
+}
+
+void pushGray(Obj* object)
+{
+    if (workerCount == 0) initMarkers();
+    dequePush(localDeque, object);
+}
+
+void parallelTrace(void (*blacken)(Obj*))
+{
+    if (workerCount == 0) initMarkers();
+
+    blackenObject = blacken;
+    atomic_store(&activeWorkers, workerCount);
+
+    pthread_mutex_lock(&poolMutex);
+    running = workerCount - 1;
+    generation++;
+    pthread_cond_broadcast(&poolStart);
+    pthread_mutex_unlock(&poolMutex);
+
+    drain(0);
+
+    pthread_mutex_lock(&poolMutex);
+    while (running > 0)
+    {
+        pthread_cond_wait(&poolDone, &poolMutex);
+    }
+    pthread_mutex_unlock(&poolMutex);
+
+    // 没人再偷了，可以释放扩容时留下的旧缓冲区
+    for (int i = 0; i < workerCount; ++i)
+    {
+        GrayBuffer* buffer = atomic_load(&deques[i].buffer);
+        GrayBuffer* retired = buffer->retired;
+        buffer->retired = NULL;
+        while (retired != NULL)
+        {
+            GrayBuffer* next = retired->retired;
+            free(retired);
+            retired = next;
+        }
+    }
+}
+
+void freeMarkers()
+{
+    if (workerCount == 0) return;
+
+    pthread_mutex_lock(&poolMutex);
+    shutdown = true;
+    pthread_cond_broadcast(&poolStart);
+    pthread_mutex_unlock(&poolMutex);
+
+    for (int i = 1; i < workerCount; ++i)
+    {
+        pthread_join(workers[i], NULL);
+    }
+
+    for (int i = 0; i < workerCount; ++i)
+    {
+        GrayBuffer* buffer = atomic_load(&deques[i].buffer);
+        while (buffer != NULL)
+        {
+            GrayBuffer* next = buffer->retired;
+            free(buffer);
+            buffer = next;
+        }
+    }
+
+    workerCount = 0;
+    shutdown = false;
+}
+
+#endif
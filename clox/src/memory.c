@@ -1,31 +1,135 @@
+#include <stdio.h>
 #include <stdlib.h>
 
+#include "allocprof.h"
 #include "compiler.h"
+#include "coverage.h"
+#include "debug.h"
+#include "flight.h"
+#include "gc.h"
+#include "heap.h"
+#include "image.h"
+#include "marker.h"
 #include "memory.h"
+#include "opstats.h"
+#include "probes.h"
+#include "profiler.h"
 #include "vm.h"
 
-#ifdef DEBUG_LOG_GC
-#include <stdio.h>
-#include "debug.h"
+#ifdef GC_CONCURRENT
+#include <pthread.h>
+#include <stdatomic.h>
 #endif
 
-#define GC_HEAP_GROW_FACTOR     2
+#ifdef GC_CONCURRENT
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize)
+#define GC_MARK_BATCH           64      // 标记线程每拿一次锁最多染黑的对象数
+#define GC_MARK_OVERSHOOT       2       // 标记没跟上时，堆最多超出阈值的倍数，超过就等标记线程
+
+static pthread_t markThread;
+static pthread_mutex_t heapMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t markRequest = PTHREAD_COND_INITIALIZER;  // 通知标记线程开工
+static pthread_cond_t markFinish = PTHREAD_COND_INITIALIZER;   // 通知主线程标记结束
+static bool markThreadStarted = false;
+static bool markPending = false;        // 受heapMutex保护
+static bool markShutdown = false;       // 受heapMutex保护
+static atomic_bool markDone;            // 主线程不拿锁轮询
+
+void lockHeap()
 {
-    vm.bytesAllocated += newSize - oldSize;
+    pthread_mutex_lock(&heapMutex);
+}
+
+void unlockHeap()
+{
+    pthread_mutex_unlock(&heapMutex);
+}
+
+#endif
 
+static void collect(bool full);
+
+// 记账，内存增长时看看要不要GC，超过堆上限时报内存不足，此时什么都还没分配
+static void accountBytes(size_t oldSize, size_t newSize)
+{
     if (newSize > oldSize)      // 区分是GC调用还是扩容
     {
+        size_t growth = newSize - oldSize;
+
         #ifdef DEBUG_STRESS_GC  // 每次分配内存的时候强制GC一次
         collectGarbage();
         #endif
 
-        if (vm.bytesAllocated > vm.nextGC)
+        if (vm.bytesAllocated + growth > vm.nextGC)
         {
             collectGarbage();
         }
+
+        if (gcPolicy.maxHeap > 0 && vm.bytesAllocated + growth > gcPolicy.maxHeap)
+        {
+            collect(true);  // 先彻底收一次再说
+
+            #ifdef GC_CONCURRENT
+            // 快照之后才死的对象这一轮收不掉，再来一轮
+            if (vm.bytesAllocated + growth > gcPolicy.maxHeap) collect(true);
+            #endif
+
+            if (vm.bytesAllocated + growth > gcPolicy.maxHeap) outOfMemory();
+        }
+    }
+
+    vm.bytesAllocated += newSize - oldSize;
+}
+
+void reserveMemory(size_t size)
+{
+    accountBytes(0, size);
+    vm.bytesAllocated -= size;
+}
+
+Obj* allocateObjectMemory(size_t size, ObjType type)
+{
+    accountBytes(0, heapSlotSize(size));    // 先GC再拿槽，刚拿到的槽不会被清理掉
+    gcStats.allocations++;
+    return heapAllocate(size, type);
+}
+
+void* reallocateFixed(void* pointer, size_t oldSize, size_t newSize)
+{
+    // 小块按实际占用的槽记账，大块交给libc
+    size_t oldCharge = oldSize <= HEAP_SMALL_MAX ? heapSlotSize(oldSize) : oldSize;
+    size_t newCharge = newSize <= HEAP_SMALL_MAX ? heapSlotSize(newSize) : newSize;
+    accountBytes(oldCharge, newCharge);
+    if (newSize > oldSize) gcStats.allocations++;
+
+    if (pointer != NULL)
+    {
+        if (oldSize <= HEAP_SMALL_MAX)
+        {
+            heapFreeFixed(pointer);
+        }
+        else
+        {
+            free(pointer);
+        }
+    }
+
+    if (newSize == 0) return NULL;
+    if (newSize <= HEAP_SMALL_MAX) return heapAllocateFixed(newSize);
+
+    void* result = malloc(newSize);
+    if (result == NULL)
+    {
+        vm.bytesAllocated -= newCharge;
+        outOfMemory();
     }
+    return result;
+}
+
+void* reallocate(void* pointer, size_t oldSize, size_t newSize)
+{
+    accountBytes(oldSize, newSize);
+    if (newSize > oldSize) gcStats.allocations++;
 
     if (newSize == 0)
     {
@@ -33,23 +137,36 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize)
         return NULL;
     }
 
-    void* result = realloc(pointer, newSize);
-    if (result == NULL) exit(1);
+    void* result = realloc(pointer, newSize);     // 失败时原来的内存还在
+    if (result == NULL)
+    {
+        vm.bytesAllocated -= newSize - oldSize;
+        outOfMemory();
+    }
     return result;
 }
 
 void markObject(Obj* object)
 {
     if (object == NULL) return;
-    if (object->isMarked) return;
+    if (isMarked(object)) return;
 
-    #ifdef DEBUG_LOG_GC
-    printf("%p mark ", (void*)object);
-    printValue(OBJ_VAL(object));
-    printf("\n");
+    #ifdef GC_PARALLEL_MARK
+    // 多个线程可能同时看到同一个白色对象，只有原子地置上标记位的那个负责把它变灰
+    if (!setMarked(object)) return;
     #endif
 
-    object->isMarked = true;
+    if (debugOptions.logGC)
+    {
+        printf("%p mark ", (void*)object);
+        printValue(OBJ_VAL(object));
+        printf("\n");
+    }
+
+    #ifdef GC_PARALLEL_MARK
+    pushGray(object);
+    #else
+    setMarked(object);
 
     if (vm.grayCapacity < vm.grayCount + 1)
     {
@@ -60,6 +177,7 @@ void markObject(Obj* object)
     }
 
     vm.grayStack[vm.grayCount++] = object;
+    #endif
 }
 
 void markValue(Value value)
@@ -67,63 +185,57 @@ void markValue(Value value)
     if (IS_OBJ(value)) markObject(AS_OBJ(value));   // 只管理堆上的Object
 }
 
-// 释放单个对象
+// 释放单个对象拥有的内存，对象本身占的槽由堆回收
 static void freeObject(Obj* object)
 {
-    #ifdef DEBUG_LOG_GC // 释放对象时打印
-    printf("%p free type %d\n", (void*)object, object->type);
-    #endif
+    if (debugOptions.logGC) // 释放对象时打印
+    {
+        printf("%p free type %d\n", (void*)object, object->type);
+    }
+
+    gcCountFreed(object->type);
+    if (allocProfile.enabled) allocProfileFree(object);
 
     switch (object->type)
     {
-        case OBJ_BOUND_METHOD:
-            FREE(ObjBoundMethod, object);
-            break;
         case OBJ_INSTANCE:
         {
             ObjInstance* instance = (ObjInstance*)object;
             freeTable(&instance->fields);
-            FREE(ObjInstance, object);
             break;
         }
         case OBJ_CLASS:
         {
             ObjClass* klass = (ObjClass*)object;
             freeTable(&klass->methods);
-            FREE(ObjClass, object);
             break;
         }
         case OBJ_FUNCTION:
         {
             ObjFunction* function = (ObjFunction*)object;
+            // 统计表按字节码地址认函数，地址释放以后会给别的函数用
+            if (coverage.enabled) coverageRelease(function);
+            if (opstats.enabled) opstatsRelease(function);
+            if (allocProfile.enabled) allocProfileRelease(function);
             freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
             break;
         }
         case OBJ_STRING:
         {
             ObjString* string = (ObjString*)object; // 多态
-            FREE_APPLY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
-            break;
-        }
-        case OBJ_NATIVE:
-        {
-            FREE(ObjNative, object);
+            FREE(char, string->chars, string->length + 1);
             break;
         }
         case OBJ_CLOSURE:
         {
             ObjClosure* closure = (ObjClosure*)object;
-            FREE_APPLY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);  // 只释放指针，值留着取悦即将到来的GC神灵
-            FREE(ObjClosure, object);   // 不释放闭包中的函数内存，因为闭包不拥有函数
-            break;
+            FREE(UpvalueRef, closure->upvalues, closure->upvalueCount);  // 只释放指针，值留着取悦即将到来的GC神灵
+            break;  // 不释放闭包中的函数内存，因为闭包不拥有函数
         }
+        case OBJ_BOUND_METHOD:
+        case OBJ_NATIVE:
         case OBJ_UPVALUE:
-        {
-            FREE(ObjUpvalue, object);
             break;
-        }
     }
 }
 
@@ -154,6 +266,9 @@ static void markRoots()
     // 编译期间用到的内存
     markCompilerRoots();
 
+    // 读堆镜像时已经建好、还没挂到全局变量上的对象
+    markImageRoots();
+
     // 驻留的字符串
     markObject((Obj*)vm.initString);
 }
@@ -170,11 +285,12 @@ static void markArray(ValueArray* array)
 // 跟踪不同的对象
 static void blackenObject(Obj* object)
 {
-    #ifdef DEBUG_LOG_GC
-    printf("%p blacken ", (void*)object);
-    printValue(OBJ_VAL(object));
-    printf("\n");
-    #endif
+    if (debugOptions.logGC)
+    {
+        printf("%p blacken ", (void*)object);
+        printValue(OBJ_VAL(object));
+        printf("\n");
+    }
 
     switch (object->type)
     {
@@ -205,7 +321,7 @@ static void blackenObject(Obj* object)
             markObject((Obj*)closure->function);
             for (int i = 0; i < closure->upvalueCount; ++i)
             {
-                markObject((Obj*)closure->upvalues[i]);
+                markObject((Obj*)UPVALUE_AT(closure, i));
             }
             break;
         }
@@ -228,77 +344,339 @@ static void blackenObject(Obj* object)
 // 三色抽象
 static void traceReferences()
 {
+    #ifdef GC_PARALLEL_MARK
+    parallelTrace(blackenObject);   // blackenObject只读对象，标记靠CAS，可以多线程跑
+    #else
     while (vm.grayCount > 0)
     {
         Obj* object = vm.grayStack[--vm.grayCount];
         blackenObject(object);
     }
-    
+    #endif
 }
 
-// 清理垃圾
+
+// 清理垃圾：扫每页的位图，不再顺着对象链表挨个跳
 static void sweep()
 {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
-    while (object != NULL)
+    vm.bytesAllocated -= heapSweep(freeObject);
+}
+
+#ifdef GC_CONCURRENT
+
+// 后台标记线程：从根快照出发，分批持锁清空灰色工作表
+static void* markThreadMain(void* arg)
+{
+    (void)arg;
+    lockHeap();
+    for (;;)
     {
-        if (object->isMarked)
+        while (!markPending && !markShutdown)
         {
-            object->isMarked = false;   // 为下一轮做准备
-
-            previous = object;
-            object = object->next;
+            pthread_cond_wait(&markRequest, &heapMutex);
         }
-        else
+        if (markShutdown) break;
+
+        int budget = GC_MARK_BATCH;
+        while (vm.grayCount > 0)
         {
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL)
-            {
-                previous->next = object;
-            }
-            else
+            Obj* object = vm.grayStack[--vm.grayCount];
+            blackenObject(object);
+
+            if (--budget == 0)  // 让写屏障有机会拿到锁
             {
-                vm.objects = object;
+                budget = GC_MARK_BATCH;
+                unlockHeap();
+                lockHeap();
             }
-
-            freeObject(unreached);
         }
+
+        markPending = false;
+        atomic_store(&markDone, true);
+        pthread_cond_broadcast(&markFinish);
     }
-    
+    unlockHeap();
+    return NULL;
 }
 
-void collectGarbage()
+// 等后台标记线程把当前工作表清空
+static void waitForMarking()
 {
-    #ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
+    lockHeap();
+    while (markPending)
+    {
+        pthread_cond_wait(&markFinish, &heapMutex);
+    }
+    unlockHeap();
+}
+
+// 开始一个并发周期：停顿扫描根，之后交给标记线程
+static void beginConcurrentCycle()
+{
+    if (!markThreadStarted)
+    {
+        if (pthread_create(&markThread, NULL, markThreadMain, NULL) != 0) exit(1);
+        markThreadStarted = true;
+    }
+
+    lockHeap();
+    markRoots();
+    vm.marking = true;  // 之后分配的对象都是黑色
+    atomic_store(&markDone, false);
+    markPending = true;
+    pthread_cond_signal(&markRequest);
+    unlockHeap();
+}
+
+// 结束并发标记：停顿重新标记根，补齐写屏障留下的灰色对象，之后照常清理
+static void finishMarking()
+{
+    waitForMarking();
+
+    markRoots();
+    traceReferences();
+
+    vm.marking = false; // 清理驻留表时删除不能再触发写屏障
+}
+
+#endif
+
+// full为true时一次收完，并发模式下不再等标记线程慢慢跑
+static void collect(bool full)
+{
+    (void)full;     // 只有并发模式用得上
+    double start = gcNow();
+
+    #ifdef GC_CONCURRENT
+    if (!vm.marking)
+    {
+        if (debugOptions.logGC)
+        {
+            printf("-- gc mark start\n");
+        }
+
+        beginConcurrentCycle();
+        if (!full)
+        {
+            gcRecordPause(gcNow() - start);
+            return;
+        }
+    }
+
+    // 标记线程还没跑完，只要堆没有失控就继续让主线程跑
+    if (!full && !atomic_load(&markDone) && vm.bytesAllocated < vm.nextGC * GC_MARK_OVERSHOOT) return;
     #endif
 
+    if (debugOptions.logGC)
+    {
+        printf("-- gc begin\n");
+    }
+    size_t before = vm.bytesAllocated;
+    if (flight.enabled) flightRecord(FLIGHT_GC_BEGIN, vm.frameCount, 0, 0, (uint32_t)(before / 1024));
+    PROBE1(gc__start, before);
+    int profiledState = profileState;
+    profileState = PROFILE_GC;
+
+    #ifdef GC_CONCURRENT
+    finishMarking();
+    #else
     markRoots();
     traceReferences();
+    #endif
+
+    double marked = gcNow();
     tableRemoveWhite(&vm.strings);
     sweep();
+    if (allocProfile.enabled) allocProfileCollected();
+
+    gcRecordCycle(before, marked - start, gcNow() - marked);   // 顺便按策略定下一次的阈值
+
+    if (vm.bytesAllocated > GC_COMPACT_MIN_BYTES && heapFragmentation() > GC_COMPACT_THRESHOLD)
+    {
+        vm.compactPending = true;   // 这里可能在任何一次分配里，得等到安全点再搬对象
+    }
+    profileState = profiledState;
+    if (flight.enabled) flightRecord(FLIGHT_GC_END, vm.frameCount, 0, 0, (uint32_t)(vm.bytesAllocated / 1024));
+    PROBE1(gc__done, vm.bytesAllocated);
+
+    if (debugOptions.logGC)
+    {
+        printf("-- gc end\n");
+        printf("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm.bytesAllocated, before, vm.bytesAllocated,
+            vm.nextGC);
+    }
+}
+
+void collectGarbage()
+{
+    collect(false);
+}
+
+// 修一个引用
+static void fixValue(Value* value)
+{
+    if (IS_OBJ(*value)) *value = OBJ_VAL(heapForward(AS_OBJ(*value)));
+}
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+static void fixTable(Table* table)
+{
+    for (int i = 0; i < table->capacity; ++i)
+    {
+        Entry* entry = &table->entries[i];
+        entry->key = KEY_REF(heapForward((Obj*)KEY_STRING(entry->key)));    // 哈希值存在字符串里，不用重新散列
+        Value value = entry->value;     // 压缩模式下表项是紧凑排列的，不能直接取值的地址
+        fixValue(&value);
+        entry->value = value;
+    }
+}
 
-    #ifdef DEBUG_LOG_GC
-    printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm.bytesAllocated, before, vm.bytesAllocated,
-        vm.nextGC);
+// 修一个对象里的所有引用，和blackenObject走的是同样的边
+static void fixObject(Obj* object)
+{
+    switch (object->type)
+    {
+        case OBJ_BOUND_METHOD:
+        {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            fixValue(&bound->receiver);
+            bound->method = (ObjClosure*)heapForward((Obj*)bound->method);
+            break;
+        }
+        case OBJ_INSTANCE:
+        {
+            ObjInstance* instance = (ObjInstance*)object;
+            instance->klass = (ObjClass*)heapForward((Obj*)instance->klass);
+            fixTable(&instance->fields);
+            break;
+        }
+        case OBJ_CLASS:
+        {
+            ObjClass* klass = (ObjClass*)object;
+            klass->name = (ObjString*)heapForward((Obj*)klass->name);
+            fixTable(&klass->methods);
+            break;
+        }
+        case OBJ_CLOSURE:
+        {
+            ObjClosure* closure = (ObjClosure*)object;
+            closure->function = (ObjFunction*)heapForward((Obj*)closure->function);
+            if (sizeof(UpvalueRef) * closure->upvalueCount <= HEAP_SMALL_MAX)
+            {
+                closure->upvalues = (UpvalueRef*)heapRelocateFixed(closure->upvalues);
+            }
+            for (int i = 0; i < closure->upvalueCount; ++i)
+            {
+                closure->upvalues[i] = UPVALUE_REF(heapForward((Obj*)UPVALUE_AT(closure, i)));
+            }
+            break;
+        }
+        case OBJ_FUNCTION:
+        {
+            ObjFunction* function = (ObjFunction*)object;
+            function->name = (ObjString*)heapForward((Obj*)function->name);
+            for (int i = 0; i < function->chunk.constants.count; ++i)
+            {
+                fixValue(&function->chunk.constants.values[i]);
+            }
+            break;
+        }
+        case OBJ_UPVALUE:
+        {
+            ObjUpvalue* upvalue = (ObjUpvalue*)object;
+            fixValue(&upvalue->closed);
+            upvalue->next = (ObjUpvalue*)heapForward((Obj*)upvalue->next);
+            if (upvalue->location < vm.stack || upvalue->location >= vm.stack + STACK_MAX)
+            {
+                upvalue->location = &upvalue->closed;   // 关闭的上值指向自己，跟着搬了家
+            }
+            break;
+        }
+        case OBJ_STRING:
+        {
+            ObjString* string = (ObjString*)object;
+            if ((size_t)string->length + 1 <= HEAP_SMALL_MAX)
+            {
+                string->chars = (char*)heapRelocateFixed(string->chars);
+            }
+            break;
+        }
+        case OBJ_NATIVE:
+            break;
+    }
+}
+
+void compactHeap()
+{
+    vm.compactPending = false;
+
+    #ifdef GC_CONCURRENT
+    if (vm.marking) return;     // 标记线程还在读对象，这一轮不整理
     #endif
+
+    if (!heapPlanCompaction()) return;
+
+    // 样本里的函数指针搬家前解析掉，整理期间的样本不记栈帧
+    profilerDrain();
+    profileState = PROFILE_COMPACT;
+
+    if (debugOptions.logGC)
+    {
+        printf("-- compact begin (fragmentation %.2f)\n", heapFragmentation());
+    }
+
+    if (flight.enabled) flightRecord(FLIGHT_COMPACT, vm.frameCount, 0, 0, (uint32_t)(vm.bytesAllocated / 1024));
+    heapEvacuate();
+
+    // 根：和markRoots一样
+    for (Value* slot = vm.stack; slot < vm.stackTop; ++slot)
+    {
+        fixValue(slot);
+    }
+    for (int i = 0; i < vm.frameCount; ++i)
+    {
+        vm.frames[i].closure = (ObjClosure*)heapForward((Obj*)vm.frames[i].closure);
+    }
+    vm.openUpvalues = (ObjUpvalue*)heapForward((Obj*)vm.openUpvalues);
+    fixTable(&vm.globals);
+    fixTable(&vm.strings);
+    vm.initString = (ObjString*)heapForward((Obj*)vm.initString);
+
+    heapForEachObject(fixObject);   // 搬过去的新副本也在里面
+    if (allocProfile.enabled) allocProfileRelocate();
+    heapFinishCompaction();
+    profileState = PROFILE_MUTATOR;
+
+    if (debugOptions.logGC)
+    {
+        printf("-- compact end (fragmentation %.2f)\n", heapFragmentation());
+    }
 }
 
 void freeObjects()
 {
-    Obj* object = vm.objects;
-    while (object != NULL)
+    #ifdef GC_CONCURRENT
+    if (markThreadStarted)
     {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+        waitForMarking();
+
+        lockHeap();
+        markShutdown = true;
+        pthread_cond_signal(&markRequest);
+        unlockHeap();
+
+        pthread_join(markThread, NULL);
+        markThreadStarted = false;
+        markShutdown = false;
     }
+    vm.marking = false;
+    #endif
+
+    #ifdef GC_PARALLEL_MARK
+    freeMarkers();
+    #endif
+
+    freeHeap(freeObject);  // 整页释放
+    gcCloseStats();
 
     free(vm.grayStack);
 }
\ No newline at end of file
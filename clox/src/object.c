@@ -1,8 +1,12 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "allocprof.h"
+#include "debug.h"
+#include "heap.h"
 #include "memory.h"
 #include "object.h"
+#include "probes.h"
 #include "value.h"
 #include "vm.h"
 #include "table.h"
@@ -14,31 +18,39 @@
 // 所有对象申请内存都经过这个函数
 static Obj* allocateObject(size_t size, ObjType type)
 {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    Obj* object = allocateObjectMemory(size, type);
     object->type = type;
-    object->isMarked = false;
-
-    object->next = vm.objects;  // 插入头部
-    vm.objects = object;
-
-    #ifdef DEBUG_LOG_GC // 对象分配时打印
-    printf("%p allocate %zu for %d\n", (void*)object, size, type);
+    #ifdef GC_CONCURRENT
+    if (vm.marking) setMarked(object);  // 标记期间出生的对象直接算黑色
     #endif
 
+    if (debugOptions.logGC) // 对象分配时打印
+    {
+        printf("%p allocate %zu for %d\n", (void*)object, size, type);
+    }
+    if (allocProfile.enabled) allocProfileObject(object, size);
+
     return object;
 }
 
 ObjClosure* newClosure(ObjFunction* function)
 {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+    // 先有闭包再申请上值数组：数组申请失败时闭包只是个没人要的对象，反过来数组就漏了
+    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    closure->function = function;
+    closure->upvalues = NULL;
+    closure->upvalueCount = 0;
+
+    push(OBJ_VAL(closure));
+    UpvalueRef* upvalues = ALLOCATE(UpvalueRef, function->upvalueCount);
+    pop();
+    if (allocProfile.enabled && function->upvalueCount > 0) allocProfileOwned(sizeof(UpvalueRef) * function->upvalueCount);
 
     for (int i = 0; i < function->upvalueCount; ++i)
     {
-        upvalues[i] = NULL;
+        upvalues[i] = UPVALUE_REF(NULL);
     }
 
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-    closure->function = function;
     closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
     return closure;
@@ -71,7 +83,9 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method)
 // 申请字符串类型的内存
 static ObjString* allocateString(char* chars, int length, uint32_t hash)
 {
+    PROBE2(string__intern, chars, length);
     ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    if (allocProfile.enabled) allocProfileOwned(length + 1);
     string->length = length;
     string->chars = chars;
     string->hash = hash;
@@ -100,6 +114,7 @@ ObjFunction* newFunction()
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->id = 0;
     function->name = NULL;
     initChunk(&function->chunk);
     return function;
@@ -112,6 +127,12 @@ ObjNative* newNative(NativeFn function)
     return native;
 }
 
+void reserveString(int length)
+{
+    size_t chars = (size_t)length + 1;
+    reserveMemory(heapSlotSize(sizeof(ObjString)) + (chars <= HEAP_SMALL_MAX ? heapSlotSize(chars) : chars));
+}
+
 ObjString* takeString(char* chars, int length)  // 字符串连接时使用
 {
     uint32_t hash = hashString(chars, length);
@@ -119,7 +140,8 @@ ObjString* takeString(char* chars, int length)  // 字符串连接时使用
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash);  // 如果拼接出的字符串在hash表中有就将其返回
     if (interned != NULL) 
     {
-        FREE_APPLY(char, chars, length + 1);
+        FREE(char, chars, length + 1);
+        SHADE_OBJECT(interned);
         return interned;
     }
 
@@ -131,8 +153,13 @@ ObjString* copyString(const char* chars, int length)    // 从源代码到ObjStr
     uint32_t hash = hashString(chars, length);
 
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash);    // 确保每个相同的字符串都是同一块内存
-    if (interned != NULL) return interned;
+    if (interned != NULL)
+    {
+        SHADE_OBJECT(interned);     // 快照里可能已经不可达，被重新拿出来就要补标记
+        return interned;
+    }
 
+    reserveString(length);
     char* heapChars = ALLOCATE(char, length + 1);   // 复制字符串而不是用原有的是因为字符串可以添加字符
     memcpy(heapChars, chars, length);
     heapChars[length] = '\0';
@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "opstats.h"
+
+OpStats opstats = { .lastOpcode = -1 };
+
+// 调用点：按指令地址区分，字节码数组不跟着对象搬家
+typedef struct
+{
+    uint8_t* ip;
+    uint8_t opcode;             // 退出时字节码可能已经释放了，指令先记下来
+    uint64_t count;
+    char* description;          // 第一次遇到时生成：函数名:行号 .属性名
+} Site;
+
+static Site* sites = NULL;
+static int siteCount = 0;
+static int siteCapacity = 0;
+
+// 函数释放以后它的调用点：地址会给别的函数用，从表里摘出来，次数留着打印
+static Site* released = NULL;
+static int releasedCount = 0;
+static int releasedCapacity = 0;
+
+static const char* opcodeNames[OPCODE_COUNT] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_ADD] = "OP_ADD",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_INHERIT] = "OP_INHERIT",
+    [OP_GET_SUPER] = "OP_GET_SUPER",
+    [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+};
+
+static void opstatsReport();
+
+bool opstatsOption(const char* arg)
+{
+    if (strcmp(arg, "--opcode-stats") == 0)
+    {
+        opstats.enabled = true;
+    }
+    else if (strcmp(arg, "--opcode-cycles") == 0)
+    {
+        opstats.enabled = true;
+        opstats.cycles = true;
+    }
+    else
+    {
+        return false;
+    }
+
+    static bool registered = false;
+    if (!registered)
+    {
+        atexit(opstatsReport);  // 运行时错误时main直接exit，也要打印
+        registered = true;
+    }
+    return true;
+}
+
+static uint32_t hashPointer(uint8_t* pointer)
+{
+    uint64_t bits = (uint64_t)(uintptr_t)pointer;
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+static void growSites()
+{
+    int oldCapacity = siteCapacity;
+    Site* old = sites;
+
+    siteCapacity = siteCapacity < 64 ? 64 : siteCapacity * 2;
+    sites = calloc(siteCapacity, sizeof(Site));
+    if (sites == NULL)
+    {
+        fprintf(stderr, "Not enough memory for opcode stats.\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < oldCapacity; ++i)
+    {
+        if (old[i].ip == NULL) continue;
+        uint32_t index = hashPointer(old[i].ip) & (siteCapacity - 1);
+        while (sites[index].ip != NULL) index = (index + 1) & (siteCapacity - 1);
+        sites[index] = old[i];
+    }
+    free(old);
+}
+
+static char* describeSite(ObjFunction* function, uint8_t* ip)
+{
+    int offset = (int)(ip - function->chunk.code);
+    Value name = function->chunk.constants.values[ip[1]];  // 两条指令的操作数都是属性名常量
+
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "%s:%d .%s", function->name != NULL ? function->name->chars : "<script>",
+        getLine(&function->chunk, offset), IS_STRING(name) ? AS_CSTRING(name) : "?");
+    return strdup(buffer);
+}
+
+void opstatsSite(ObjFunction* function, uint8_t* ip)
+{
+    if ((siteCount + 1) * 4 > siteCapacity * 3) growSites();
+
+    uint32_t index = hashPointer(ip) & (siteCapacity - 1);
+    while (sites[index].ip != NULL)
+    {
+        if (sites[index].ip == ip)
+        {
+            sites[index].count++;
+            return;
+        }
+        index = (index + 1) & (siteCapacity - 1);
+    }
+
+    sites[index].ip = ip;
+    sites[index].opcode = *ip;
+    sites[index].count = 1;
+    sites[index].description = describeSite(function, ip);
+    siteCount++;
+}
+
+// 线性探测的删除：后面同一串里能挪到空位上的往前挪
+static void removeSite(uint32_t index)
+{
+    uint32_t mask = siteCapacity - 1;
+    uint32_t hole = index;
+    for (uint32_t next = (hole + 1) & mask; sites[next].ip != NULL; next = (next + 1) & mask)
+    {
+        uint32_t home = hashPointer(sites[next].ip) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            sites[hole] = sites[next];
+            hole = next;
+        }
+    }
+    memset(&sites[hole], 0, sizeof(Site));
+    siteCount--;
+}
+
+void opstatsRelease(ObjFunction* function)
+{
+    // 常量可能已经在同一轮里释放了，没法按指令走，逐个字节查
+    Chunk* chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->count && siteCount > 0; ++offset)
+    {
+        uint8_t* ip = chunk->code + offset;
+        uint32_t index = hashPointer(ip) & (siteCapacity - 1);
+        while (sites[index].ip != NULL && sites[index].ip != ip) index = (index + 1) & (siteCapacity - 1);
+        if (sites[index].ip == NULL) continue;
+
+        if (releasedCount + 1 > releasedCapacity)
+        {
+            releasedCapacity = releasedCapacity < 64 ? 64 : releasedCapacity * 2;
+            released = realloc(released, sizeof(Site) * releasedCapacity);
+            if (released == NULL)
+            {
+                fprintf(stderr, "Not enough memory for opcode stats.\n");
+                exit(1);
+            }
+        }
+        released[releasedCount++] = sites[index];
+        removeSite(index);
+    }
+}
+
+static int compareOpcode(const void* a, const void* b)
+{
+    uint64_t x = opstats.counts[*(const int*)a];
+    uint64_t y = opstats.counts[*(const int*)b];
+    return (y > x) - (y < x);
+}
+
+static int compareSite(const void* a, const void* b)
+{
+    const Site* x = *(Site* const*)a;
+    const Site* y = *(Site* const*)b;
+    return (y->count > x->count) - (y->count < x->count);
+}
+
+static void reportSites(OpCode opcode, Site** sorted, int count)
+{
+    fprintf(stderr, "\nTop %s sites:\n", opcodeNames[opcode]);
+
+    int printed = 0;
+    for (int i = 0; i < count && printed < OPSTATS_TOP_SITES; ++i)
+    {
+        if (sorted[i]->opcode != opcode) continue;
+        fprintf(stderr, "  %14llu  %s\n", (unsigned long long)sorted[i]->count, sorted[i]->description);
+        printed++;
+    }
+}
+
+static void opstatsReport()
+{
+    uint64_t total = 0;
+    uint64_t totalCycles = 0;
+    int order[OPCODE_COUNT];
+    for (int i = 0; i < OPCODE_COUNT; ++i)
+    {
+        order[i] = i;
+        total += opstats.counts[i];
+        totalCycles += opstats.cycleCounts[i];
+    }
+    if (total == 0) return;
+
+    qsort(order, OPCODE_COUNT, sizeof(int), compareOpcode);
+
+    fprintf(stderr, "\n%-18s %14s %7s", "opcode", "count", "%");
+    if (opstats.cycles) fprintf(stderr, " %16s %7s %10s", "cycles", "%", "cycles/op");
+    fprintf(stderr, "\n");
+
+    for (int i = 0; i < OPCODE_COUNT; ++i)
+    {
+        int opcode = order[i];
+        uint64_t count = opstats.counts[opcode];
+        if (count == 0) break;
+
+        fprintf(stderr, "%-18s %14llu %6.2f%%", opcodeNames[opcode], (unsigned long long)count, 100.0 * count / total);
+        if (opstats.cycles)
+        {
+            uint64_t cycles = opstats.cycleCounts[opcode];
+            fprintf(stderr, " %16llu %6.2f%% %10.1f", (unsigned long long)cycles,
+                totalCycles > 0 ? 100.0 * cycles / totalCycles : 0, (double)cycles / count);
+        }
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, "%-18s %14llu\n", "total", (unsigned long long)total);
+
+    // 调用点按次数排序，两种指令分开打印
+    Site** sorted = malloc(sizeof(Site*) * (siteCount + releasedCount > 0 ? siteCount + releasedCount : 1));
+    int count = 0;
+    for (int i = 0; i < siteCapacity; ++i)
+    {
+        if (sites[i].ip != NULL) sorted[count++] = &sites[i];
+    }
+    for (int i = 0; i < releasedCount; ++i)
+    {
+        sorted[count++] = &released[i];
+    }
+    qsort(sorted, count, sizeof(Site*), compareSite);
+
+    reportSites(OP_INVOKE, sorted, count);
+    reportSites(OP_GET_PROPERTY, sorted, count);
+
+    free(sorted);
+    for (int i = 0; i < siteCapacity; ++i)
+    {
+        free(sites[i].description);
+    }
+    for (int i = 0; i < releasedCount; ++i)
+    {
+        free(released[i].description);
+    }
+    free(sites);
+    free(released);
+    sites = NULL;
+    released = NULL;
+    siteCount = siteCapacity = 0;
+    releasedCount = releasedCapacity = 0;
+}
@@ -0,0 +1,287 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "profiler.h"
+#include "vm.h"
+
+#define STACK_TEXT_MAX          4096    // 一条折叠栈的最大长度，更深的截掉
+
+// 信号处理函数抄下来的一帧：函数和正在执行的指令偏移
+typedef struct
+{
+    ObjFunction* function;
+    int offset;
+} SampleFrame;
+
+typedef struct
+{
+    int state;                  // 采样时虚拟机在干什么，PROFILE_*
+    int depth;
+    SampleFrame frames[FRAMES_MAX];
+} Sample;
+
+// 累计：折叠栈文本 -> 样本数，开放寻址
+typedef struct
+{
+    char* stack;
+    long count;
+} StackCount;
+
+volatile sig_atomic_t profilePending = 0;
+volatile sig_atomic_t profileState = PROFILE_MUTATOR;
+
+static const char* outputPath = NULL;
+static int frequency = PROFILE_HZ_DEFAULT;
+static bool running = false;
+static __thread bool samplingThread = false;    // 只采解释器线程，GC线程收到信号直接忽略
+
+// 环形缓冲区，head只有信号处理函数写，tail只有profilerDrain写
+static Sample samples[PROFILE_BUFFER];
+static volatile sig_atomic_t head = 0;
+static volatile sig_atomic_t tail = 0;
+static volatile sig_atomic_t dropped = 0;
+
+static StackCount* stacks = NULL;
+static int stackCount = 0;
+static int stackCapacity = 0;
+static long totalSamples = 0;
+
+bool profilerOption(const char* arg)
+{
+    if (strncmp(arg, "--profile=", 10) == 0)
+    {
+        outputPath = arg + 10;
+        return *outputPath != '\0';
+    }
+    if (strncmp(arg, "--profile-hz=", 13) == 0)
+    {
+        frequency = atoi(arg + 13);
+        return frequency > 0 && frequency <= 1000000;
+    }
+    return false;
+}
+
+// 信号处理函数：只读vm.frames、写预先分配好的缓冲区，不调任何不可重入的函数
+static void onProfileSignal(int signal)
+{
+    (void)signal;
+    if (!samplingThread) return;
+
+    int next = (head + 1) % PROFILE_BUFFER;
+    if (next == tail)
+    {
+        dropped++;
+        return;
+    }
+
+    Sample* sample = &samples[head];
+    sample->state = profileState;
+    sample->depth = 0;
+    if (sample->state != PROFILE_COMPACT)  // 整理堆时栈帧里的指针可能指着搬走的对象
+    {
+        int depth = vm.frameCount;
+        for (int i = 0; i < depth; ++i)
+        {
+            CallFrame* frame = &vm.frames[i];
+            ObjFunction* function = frame->closure->function;
+            sample->frames[i].function = function;
+            sample->frames[i].offset = (int)(frame->ip - function->chunk.code) - 1;
+        }
+        sample->depth = depth;
+    }
+
+    atomic_signal_fence(memory_order_release);  // 样本写完了才能让profilerDrain看见
+    head = next;
+    profilePending = 1;
+}
+
+static uint32_t hashText(const char* text)
+{
+    uint32_t hash = 2166136261u;
+    for (const char* c = text; *c != '\0'; ++c)
+    {
+        hash ^= (uint8_t)*c;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static void growStacks()
+{
+    int oldCapacity = stackCapacity;
+    StackCount* old = stacks;
+
+    stackCapacity = stackCapacity < 64 ? 64 : stackCapacity * 2;
+    stacks = calloc(stackCapacity, sizeof(StackCount));
+    if (stacks == NULL)
+    {
+        fprintf(stderr, "Not enough memory for the profiler.\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < oldCapacity; ++i)
+    {
+        if (old[i].stack == NULL) continue;
+        uint32_t index = hashText(old[i].stack) & (stackCapacity - 1);
+        while (stacks[index].stack != NULL) index = (index + 1) & (stackCapacity - 1);
+        stacks[index] = old[i];
+    }
+    free(old);
+}
+
+static void countStack(const char* text)
+{
+    if ((stackCount + 1) * 4 > stackCapacity * 3) growStacks();
+
+    uint32_t index = hashText(text) & (stackCapacity - 1);
+    while (stacks[index].stack != NULL)
+    {
+        if (strcmp(stacks[index].stack, text) == 0)
+        {
+            stacks[index].count++;
+            return;
+        }
+        index = (index + 1) & (stackCapacity - 1);
+    }
+
+    stacks[index].stack = strdup(text);
+    stacks[index].count = 1;
+    stackCount++;
+}
+
+// 追加一段文本，放不下就截断
+static int append(char* buffer, int length, const char* text)
+{
+    int written = snprintf(buffer + length, STACK_TEXT_MAX - length, "%s", text);
+    if (written < 0) return length;
+    return length + written >= STACK_TEXT_MAX ? STACK_TEXT_MAX - 1 : length + written;
+}
+
+// 一个样本变成一行折叠栈：<script>:12;outer:3;fib:2
+static void foldSample(Sample* sample, char* buffer)
+{
+    int length = 0;
+    buffer[0] = '\0';
+
+    if (sample->state == PROFILE_COMPILE)
+    {
+        append(buffer, length, "[compile]");
+        return;
+    }
+    if (sample->state == PROFILE_COMPACT)
+    {
+        append(buffer, length, "[compact]");
+        return;
+    }
+
+    for (int i = 0; i < sample->depth; ++i)
+    {
+        ObjFunction* function = sample->frames[i].function;
+        int offset = sample->frames[i].offset;
+        if (offset < 0) offset = 0;
+        if (offset >= function->chunk.count) offset = function->chunk.count - 1;
+
+        char frame[128];
+        snprintf(frame, sizeof(frame), "%s%s:%d", i == 0 ? "" : ";",
+            function->name != NULL ? function->name->chars : "<script>", getLine(&function->chunk, offset));
+        length = append(buffer, length, frame);
+    }
+
+    if (sample->state == PROFILE_GC)
+    {
+        length = append(buffer, length, sample->depth == 0 ? "[gc]" : ";[gc]");
+    }
+    else if (sample->depth == 0)
+    {
+        length = append(buffer, length, "[vm]");
+    }
+}
+
+void profilerDrain()
+{
+    profilePending = 0;
+    atomic_signal_fence(memory_order_acquire);
+
+    char buffer[STACK_TEXT_MAX];
+    while (tail != head)
+    {
+        foldSample(&samples[tail], buffer);
+        countStack(buffer);
+        totalSamples++;
+        tail = (tail + 1) % PROFILE_BUFFER;
+    }
+}
+
+static int compareCount(const void* a, const void* b)
+{
+    const StackCount* x = a;
+    const StackCount* y = b;
+    if (x->stack == NULL || y->stack == NULL) return (x->stack == NULL) - (y->stack == NULL);
+    return (y->count > x->count) - (y->count < x->count);
+}
+
+void stopProfiler()
+{
+    if (!running) return;
+    running = false;
+
+    struct itimerval timer = { { 0, 0 }, { 0, 0 } };
+    setitimer(ITIMER_PROF, &timer, NULL);
+    signal(SIGPROF, SIG_IGN);
+
+    // interpret()返回前已经解析过，剩下的样本里没有栈帧，不会碰到已经释放的对象
+    profilerDrain();
+
+    FILE* file = fopen(outputPath, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not open profile output \"%s\".\n", outputPath);
+    }
+    else
+    {
+        qsort(stacks, stackCapacity, sizeof(StackCount), compareCount);
+        for (int i = 0; i < stackCount; ++i)
+        {
+            fprintf(file, "%s %ld\n", stacks[i].stack, stacks[i].count);
+        }
+        fclose(file);
+    }
+
+    if (dropped > 0)
+    {
+        fprintf(stderr, "Profiler dropped %d of %ld samples.\n", (int)dropped, totalSamples + dropped);
+    }
+
+    for (int i = 0; i < stackCapacity; ++i)
+    {
+        free(stacks[i].stack);
+    }
+    free(stacks);
+    stacks = NULL;
+    stackCount = stackCapacity = 0;
+}
+
+void startProfiler()
+{
+    if (outputPath == NULL || running) return;
+
+    samplingThread = true;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onProfileSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, NULL);
+
+    long interval = 1000000 / frequency;
+    if (interval == 0) interval = 1;
+    struct itimerval timer = { { interval / 1000000, interval % 1000000 }, { interval / 1000000, interval % 1000000 } };
+    setitimer(ITIMER_PROF, &timer, NULL);
+
+    running = true;
+    atexit(stopProfiler);   // 运行时错误时main直接exit，也要写出结果
+}
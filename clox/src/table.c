@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "heap.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -26,13 +27,14 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key)
 {
     // uint32_t index = key->hash % capacity;
     uint32_t index = key->hash & (capacity - 1);
+    EntryKey ref = KEY_REF(key);    // 驻留过的字符串比地址就够了，压缩引用也一样
     Entry* tombstone = NULL;
 
     for (;;)
     {
         Entry* entry = &entries[index];
 
-        if (entry->key == NULL)
+        if (entry->key == NO_KEY)
         {
             if (IS_NIL(entry->value))
             {
@@ -43,7 +45,7 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key)
                 if (tombstone == NULL) tombstone = entry;
             }
         }
-        else if (entry->key == key) return entry;
+        else if (entry->key == ref) return entry;
 
         // index = (index + 1) % capacity;
         index = (index + 1) & (capacity - 1);
@@ -53,28 +55,34 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key)
 // 重构hash表，调整大小
 static void adjustCapacity(Table* table, int capacity)
 {
-    Entry* entries = ALLOCATE(Entry, capacity);
+    Entry* entries = GROW_APPLY(Entry, NULL, 0, capacity);
     for (int i = 0; i < capacity; ++i)
     {
         entries[i].value = NIL_VAL; // 值都设置成了nil
-        entries[i].key = NULL;
+        entries[i].key = NO_KEY;
     }
 
     table->count = 0;
     for (int i = 0; i < table->capacity; ++i)
     {
         Entry* entry = &table->entries[i];
-        if (entry->key == NULL) continue;
+        if (entry->key == NO_KEY) continue;
 
-        Entry* dest = findEntry(entries, capacity, entry->key);
+        Entry* dest = findEntry(entries, capacity, KEY_STRING(entry->key));
         dest->key = entry->key;
         dest->value = entry->value;
         table->count++; // 重构时把墓碑排除在外
     }
 
-    FREE_APPLY(Entry, table->entries, table->capacity);
+    Entry* oldEntries = table->entries;
+    int oldCapacity = table->capacity;
+
+    BARRIER_BEGIN();    // 标记线程可能正在扫旧数组，换好之后再释放
     table->entries = entries;
     table->capacity = capacity;
+    BARRIER_END();
+
+    FREE_APPLY(Entry, oldEntries, oldCapacity);
 }
 
 bool tableGet(Table* table, ObjString* key, Value* value)
@@ -82,7 +90,7 @@ bool tableGet(Table* table, ObjString* key, Value* value)
     if (table->count == 0) return false;
 
     Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    if (entry->key == NO_KEY) return false;
 
     *value = entry->value;
     return true;
@@ -97,11 +105,14 @@ bool tableSet(Table* table, ObjString* key, Value value)
     }
 
     Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
+    bool isNewKey = entry->key == NO_KEY;
     if (isNewKey && IS_NIL(entry->value)) table->count++;   // 墓碑数量排除在外
 
-    entry->key = key;
+    BARRIER_BEGIN();
+    BARRIER_SHADE(entry->value);
+    entry->key = KEY_REF(key);
     entry->value = value;
+    BARRIER_END();
     return isNewKey;
 }
 
@@ -110,10 +121,14 @@ bool tableDelete(Table* table, ObjString* key)
     if (table->count == 0) return false;
 
     Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    if (entry->key == NO_KEY) return false;
 
-    entry->key = NULL;
+    BARRIER_BEGIN();
+    BARRIER_SHADE(OBJ_VAL(key));
+    BARRIER_SHADE(entry->value);
+    entry->key = NO_KEY;
     entry->value = BOOL_VAL(true);  // 大家好，我是绿色坟墓
+    BARRIER_END();
     return true;
 }
 
@@ -122,7 +137,7 @@ void tableAddAll(Table* from, Table* to)
     for (int i = 0; i < from->capacity; i++)
     {
         Entry* entry = &from->entries[i];
-        if (entry->key != NULL) tableSet(to, entry->key, entry->value);
+        if (entry->key != NO_KEY) tableSet(to, KEY_STRING(entry->key), entry->value);
     }
 }
 
@@ -135,13 +150,14 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
     for (;;)
     {
         Entry* entry = &table->entries[index];
-        if (entry->key == NULL)
+        ObjString* key = KEY_STRING(entry->key);
+        if (key == NULL)
         {
             if (IS_NIL(entry->value)) return NULL;
         }
-        else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0)
+        else if (key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0)
         {
-            return entry->key;
+            return key;
         }
 
         index = (index + 1) & (table->capacity - 1);
@@ -153,7 +169,7 @@ void markTable(Table* table)
     for (int i = 0; i < table->capacity; ++i)
     {
         Entry* entry = &table->entries[i];
-        markObject((Obj*)entry->key);
+        markObject((Obj*)KEY_STRING(entry->key));
         markValue(entry->value);
     }
 }
@@ -163,9 +179,10 @@ void tableRemoveWhite(Table* table)
     for (int i = 0; i < table->capacity; ++i)
     {
         Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked)
+        ObjString* key = KEY_STRING(entry->key);
+        if (key != NULL && !isMarked((Obj*)key))
         {
-            tableDelete(table, entry->key);
+            tableDelete(table, key);
         }
     }
 }
\ No newline at end of file
@@ -17,12 +17,29 @@ void writeValueArray(ValueArray* array, Value value)
     if (array->capacity < array->count + 1)
     {
         int oldCapacity = array->capacity;
-        array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values = GROW_APPLY(Value, array->values, oldCapacity, array->capacity);
+        #ifdef GC_CONCURRENT
+        // 标记线程可能正在读旧数组，不能原地realloc
+        int capacity = GROW_CAPACITY(oldCapacity);
+        Value* values = GROW_APPLY(Value, NULL, 0, capacity);
+        if (array->count > 0) memcpy(values, array->values, sizeof(Value) * array->count);
+
+        Value* oldValues = array->values;
+        BARRIER_BEGIN();
+        array->values = values;
+        array->capacity = capacity;
+        BARRIER_END();
+        FREE_APPLY(Value, oldValues, oldCapacity);
+        #else
+        int capacity = GROW_CAPACITY(oldCapacity);
+        array->values = GROW_APPLY(Value, array->values, oldCapacity, capacity);
+        array->capacity = capacity;     // 申请成功了才改，内存不足跳走时记账不乱
+        #endif
     }
 
+    BARRIER_BEGIN();
     array->values[array->count] = value;
     array->count++;
+    BARRIER_END();
 }
 
 void freeValueArray(ValueArray* array)
@@ -69,7 +86,9 @@ bool valuesEqual(Value a, Value b)
 {
     #ifdef NAN_BOXING
 
-    if (IS_NUMBER(a) && IS_NUMBER(b)) 
+    if (IS_INT(a) && IS_INT(b)) return a == b;
+
+    if (IS_NUMBER(a) && IS_NUMBER(b))   // 整数和double之间按数值比
     {
         return AS_NUMBER(a) == AS_NUMBER(b);
     }
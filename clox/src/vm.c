@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
@@ -8,6 +10,16 @@
 #include "debug.h"
 #include "compiler.h"
 #include "memory.h"
+#include "allocprof.h"
+#include "bytecache.h"
+#include "codearena.h"
+#include "coverage.h"
+#include "flight.h"
+#include "gc.h"
+#include "heapdump.h"
+#include "opstats.h"
+#include "probes.h"
+#include "profiler.h"
 
 VM vm;  // 虚拟机是个全局变量
 
@@ -17,6 +29,50 @@ static Value clockNative(int argCount, Value* args)
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+// 本地函数-整理堆，本地函数里没有C代码拿着对象指针，可以直接搬
+static Value gcCompactNative(int argCount, Value* args)
+{
+    compactHeap();
+    return NIL_VAL;
+}
+
+// 本地函数-GC统计，gcStat("collections")，没有这一项返回nil
+static Value gcStatNative(int argCount, Value* args)
+{
+    double value;
+    if (argCount != 1 || !IS_STRING(args[0]) || !gcStatValue(AS_CSTRING(args[0]), &value)) return NIL_VAL;
+    return NUMBER_VAL(value);
+}
+
+// 本地函数-写堆快照，heapDump("heap.snapshot")，返回写了多少个对象，写不了返回nil
+static Value heapDumpNative(int argCount, Value* args)
+{
+    if (argCount != 1 || !IS_STRING(args[0])) return NIL_VAL;
+    int objects = dumpHeap(AS_CSTRING(args[0]));
+    return objects < 0 ? NIL_VAL : NUMBER_VAL(objects);
+}
+
+// 所有的本地函数，堆镜像里按名字存
+static const struct
+{
+    const char* name;
+    NativeFn function;
+} natives[] = {
+    { "clock", clockNative },
+    { "gcCompact", gcCompactNative },
+    { "gcStat", gcStatNative },
+    { "heapDump", heapDumpNative },
+};
+
+const char* nativeName(NativeFn function)
+{
+    for (size_t i = 0; i < sizeof(natives) / sizeof(natives[0]); ++i)
+    {
+        if (natives[i].function == function) return natives[i].name;
+    }
+    return NULL;
+}
+
 // 重置虚拟机的栈内存
 static void resetStack()
 {
@@ -34,13 +90,25 @@ static void runtimeError(const char* format, ...)
     va_end(args);
     fputs("\n", stderr);
 
+    if (flight.enabled)     // 出错的指令和消息记进飞行记录器，连同之前的事件一起写出去
+    {
+        char message[FLIGHT_MESSAGE];
+        va_start(args, format);
+        vsnprintf(message, sizeof(message), format, args);
+        va_end(args);
+
+        CallFrame* frame = vm.frameCount > 0 ? &vm.frames[vm.frameCount - 1] : NULL;
+        flightError(frame != NULL ? frame->closure->function : NULL, frame != NULL ? frame->ip - 1 : NULL,
+            vm.frameCount, message);
+    }
+
     // 打印调用堆栈
     for (int i = vm.frameCount - 1; i >= 0; --i)
     {
         CallFrame* frame = &vm.frames[i];
         ObjFunction* function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        fprintf(stderr, "[line %d] in ", getLine(&function->chunk, (int)instruction));
         if (function->name == NULL)
         {
             fprintf(stderr, "script\n");
@@ -54,6 +122,18 @@ static void runtimeError(const char* format, ...)
     resetStack();
 }
 
+void outOfMemory()
+{
+    if (vm.errorJump == NULL)   // 启动、退出时没地方可跳
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    runtimeError("Out of memory.");
+    longjmp(*vm.errorJump, 1);
+}
+
 // 定义本地函数 
 static void defineNative(const char* name, NativeFn function)
 {
@@ -68,25 +148,33 @@ void initVM()
 {
     freeTable(&vm.globals);
     resetStack();
-    vm.objects = NULL;
 
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
 
     vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
+    vm.nextGC = gcPolicy.initialHeap;
+    vm.compactPending = false;
+    vm.errorJump = NULL;
+    #ifdef GC_CONCURRENT
+    vm.marking = false;
+    #endif
 
     initTable(&vm.strings);
 
     vm.initString = NULL;   // GC无孔不入
     vm.initString = copyString("init", 4);
 
-    defineNative("clock", clockNative);
+    for (size_t i = 0; i < sizeof(natives) / sizeof(natives[0]); ++i)
+    {
+        defineNative(natives[i].name, natives[i].function);
+    }
 }
  
 void freeVM()
 {
+    allocProfileReport();   // 赶在整页释放之前，免得把所有对象都算成被回收
     freeTable(&vm.strings);
     vm.initString = NULL;
     freeObjects(); 
@@ -125,10 +213,14 @@ static bool call(ObjClosure* closure, int argCount)
         return false;
     }
 
-    CallFrame* frame = &vm.frames[vm.frameCount++];
+    CallFrame* frame = &vm.frames[vm.frameCount];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
     frame->slots = vm.stackTop - argCount - 1;
+    atomic_signal_fence(memory_order_release);  // 栈帧填好了才算数，采样的信号随时会来读
+    vm.frameCount++;
+    if (flight.enabled) flightRecord(FLIGHT_CALL, vm.frameCount, closure->function->id, 0, 0);
+    PROBE2(function__entry, PROBE_FUNCTION_NAME(closure->function), vm.frameCount);
     return true;
 }
 
@@ -148,6 +240,7 @@ static bool callValue(Value callee, int argCount)
             case OBJ_CLASS:
             {
                 ObjClass* klass = AS_CLASS(callee);
+                PROBE1(instance__new, klass->name->chars);
                 vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));   // 将栈中类的位置替换成实例
                 Value initializer;
                 if (tableGet(&klass->methods, vm.initString, &initializer))
@@ -157,6 +250,7 @@ static bool callValue(Value callee, int argCount)
                 else if (argCount != 0)
                 {
                     runtimeError("Expected 0 arguments but got %d.", argCount);
+                    return false;
                 }
                 return true;
             }
@@ -267,8 +361,10 @@ static void closeUpvalues(Value* last)
     {
         ObjUpvalue* upvalue = vm.openUpvalues;
 
+        BARRIER_BEGIN();
         upvalue->closed = *upvalue->location;   // 将上值独立出来
         upvalue->location = &upvalue->closed;
+        BARRIER_END();
 
         vm.openUpvalues = upvalue->next;
     }
@@ -283,6 +379,13 @@ static void defineMethod(ObjString* name)
     pop();
 }
 
+// 整数乘法：溢出或者结果是0而有一边是负数（浮点里得-0）都要交给浮点
+static inline bool multiplyOverflow(int32_t a, int32_t b, int32_t* result)
+{
+    if (__builtin_mul_overflow(a, b, result)) return true;
+    return *result == 0 && (a < 0 || b < 0);
+}
+
 // 判断假值
 static bool isFalsey(Value value)
 {
@@ -296,6 +399,7 @@ static void concatenate()
     ObjString* a = AS_STRING(peek(1));
 
     int length = a->length + b->length;
+    reserveString(length);  // 字符和字符串对象一起预留，不会申请了字符却拿不到对象
     char* chars = ALLOCATE(char, length + 1);
     memcpy(chars, a->chars, a->length);
     memcpy(chars + a->length, b->chars, b->length);
@@ -307,15 +411,49 @@ static void concatenate()
     push(OBJ_VAL(result));
 }
 
-// 指令执行-主函数
-static InterpretResult run()
+// --trace：打印栈内容和将要执行的指令
+static void traceInstruction(CallFrame* frame)
+{
+    printf("          ");
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++)
+    {
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
+}
+
+// execute的插桩开关
+#define EXEC_TRACE      1       // --trace
+#define EXEC_COUNT      2       // --opcode-stats
+#define EXEC_COVER      4       // --coverage
+#define EXEC_FLIGHT     8       // --flight-sample
+
+// 指令执行-主函数，mode是常量，强制内联后编出几份循环，平时跑的那份里没有跟踪和统计代码
+static inline __attribute__((always_inline)) InterpretResult execute(int mode)
 {
     CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    if (mode & EXEC_COVER) coverageEnter(frame->closure->function);
+    int flightCountdown = flight.sample;
 
     #define READ_BYTE() (*frame->ip++)  // vm 写成一个全局变量真的有点难受
     #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])    // 宏像不像 eval ？
     #define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
     #define READ_STRING() AS_STRING(READ_CONSTANT())
+    // 指令之间只有frame，它指向vm.frames，不怕对象搬家；采样分析器攒下的样本、要写的堆快照也在这里处理
+    // 调用之后：调的是Lox函数的话frame换成了新的栈帧，停在第一条指令上
+    #define ENTERED() \
+        if ((mode & EXEC_COVER) && frame->ip == frame->closure->function->chunk.code) \
+            coverageEnter(frame->closure->function)
+    #define SAFEPOINT() \
+        do  \
+        {   \
+            if (profilePending) profilerDrain();    \
+            if (heapDumpPending) heapDumpDrain();   \
+            if (vm.compactPending) compactHeap();   \
+        } while (false)
     #define BINAPY_OP(valueType, op) \
         do  \
         {   \
@@ -328,20 +466,40 @@ static InterpretResult run()
             double a = AS_NUMBER(pop());    \
             push(valueType(a op b));    \
         } while (false)
+    // 两边都是小整数就走整数通道，溢出了接着往下走浮点，break跳出的是指令的switch
+    #define INT_ARITH_OP(overflowOp) \
+        {   \
+            Value b = vm.stackTop[-1];  \
+            Value a = vm.stackTop[-2];  \
+            int32_t result; \
+            if (IS_INT(a) & IS_INT(b) && !overflowOp(AS_INT(a), AS_INT(b), &result))  \
+            {   \
+                vm.stackTop--;  \
+                vm.stackTop[-1] = INT_VAL(result);  \
+                break;  \
+            }   \
+        }
+    #define INT_COMPARE_OP(op) \
+        {   \
+            Value b = vm.stackTop[-1];  \
+            Value a = vm.stackTop[-2];  \
+            if (IS_INT(a) & IS_INT(b))  \
+            {   \
+                vm.stackTop--;  \
+                vm.stackTop[-1] = BOOL_VAL(AS_INT(a) op AS_INT(b)); \
+                break;  \
+            }   \
+        }
 
     for (;;)
     {
-        #ifdef DEBUG_TRACE_EXECUTION    // 反汇编
-            printf("          ");   // 打印栈内容
-            for (Value* slot = vm.stack; slot < vm.stackTop; slot++)
-            {
-                printf("[ ");
-                printValue(*slot);
-                printf(" ]");
-            }
-            printf("\n");
-            disassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
-        #endif
+        if (mode & EXEC_TRACE) traceInstruction(frame);
+        if (mode & EXEC_COUNT) opstatsInstruction(frame->closure->function, frame->ip);
+        if ((mode & EXEC_FLIGHT) && --flightCountdown == 0)
+        {
+            flightCountdown = flight.sample;
+            flightInstruction(frame->closure->function, frame->ip, vm.frameCount);
+        }
 
         uint8_t instruction;
         switch (instruction = READ_BYTE())
@@ -403,13 +561,17 @@ static InterpretResult run()
         case OP_GET_UPVALUE:
         {
             uint8_t slot = READ_BYTE();
-            push(*frame->closure->upvalues[slot]->location);    // 早就给你准备好了
+            push(*UPVALUE_AT(frame->closure, slot)->location);    // 早就给你准备好了
             break;
         }
         case OP_SET_UPVALUE:
         {
             uint8_t slot = READ_BYTE();
-            *frame->closure->upvalues[slot]->location = peek(0);
+            Value* location = UPVALUE_AT(frame->closure, slot)->location;
+            BARRIER_BEGIN();
+            BARRIER_SHADE(*location);   // 关闭的上值在堆上
+            *location = peek(0);
+            BARRIER_END();
             break;
         }
         case OP_EQUAL:
@@ -419,20 +581,21 @@ static InterpretResult run()
             push(BOOL_VAL(valuesEqual(a, b)));
             break;
         }
-        case OP_GREATER:        BINAPY_OP(BOOL_VAL, >); break;
-        case OP_LESS:           BINAPY_OP(BOOL_VAL, <); break;
+        case OP_GREATER:        INT_COMPARE_OP(>); BINAPY_OP(BOOL_VAL, >); break;
+        case OP_LESS:           INT_COMPARE_OP(<); BINAPY_OP(BOOL_VAL, <); break;
         case OP_ADD:
         {
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
-            {
-                concatenate();
-            }
-            else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+            INT_ARITH_OP(__builtin_add_overflow);
+            if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))   // 整数溢出落下来的先接住
             {
                 double b = AS_NUMBER(pop());
                 double a = AS_NUMBER(pop()); 
                 push(NUMBER_VAL(a + b));
             }
+            else if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+            {
+                concatenate();
+            }
             else
             {
                 runtimeError("Operands must be two numbers or two strings."); 
@@ -440,12 +603,17 @@ static InterpretResult run()
             }
             break;
         }
-        case OP_SUBTRACT:       BINAPY_OP(NUMBER_VAL, -); break;
-        case OP_MULTIPLY:       BINAPY_OP(NUMBER_VAL, *); break;
+        case OP_SUBTRACT:       INT_ARITH_OP(__builtin_sub_overflow); BINAPY_OP(NUMBER_VAL, -); break;
+        case OP_MULTIPLY:       INT_ARITH_OP(multiplyOverflow); BINAPY_OP(NUMBER_VAL, *); break;
         case OP_DIVIDE:         BINAPY_OP(NUMBER_VAL, /); break;
         case OP_NOT:            push(BOOL_VAL(isFalsey(pop()))); break;
         case OP_NEGATE:
         {
+            if (IS_INT(peek(0)) && AS_INT(peek(0)) != 0 && AS_INT(peek(0)) != INT32_MIN)   // -0和-INT32_MIN不是小整数
+            {
+                vm.stackTop[-1] = INT_VAL(-AS_INT(peek(0)));
+                break;
+            }
             if (!IS_NUMBER(peek(0)))
             {
                 runtimeError("Operand must be a number.");
@@ -457,13 +625,18 @@ static InterpretResult run()
         case OP_JUMP:
         {
             uint16_t offset = READ_SHORT();
+            if (mode & EXEC_COVER) coverageJump(frame->closure->function, frame->ip - 3);
             frame->ip += offset;
             break;
         }
         case OP_JUMP_IF_FALSE:
         {
             uint16_t offset = READ_SHORT();
-            if (isFalsey(peek(0))) frame->ip += offset;
+            if (isFalsey(peek(0)))
+            {
+                if (mode & EXEC_COVER) coverageJump(frame->closure->function, frame->ip - 3);
+                frame->ip += offset;
+            }
             break;
         }
         case OP_PRINT:
@@ -475,7 +648,9 @@ static InterpretResult run()
         case OP_LOOP:
         {
             uint16_t offset = READ_SHORT();
+            if (mode & EXEC_COVER) coverageJump(frame->closure->function, frame->ip - 3);
             frame->ip -= offset;
+            SAFEPOINT();
             break;
         }
         case OP_CALL:
@@ -486,6 +661,7 @@ static InterpretResult run()
                 return INTERPRET_RUNTIME_ERROR;
             }
             frame = &vm.frames[vm.frameCount - 1];  // 转到最新的栈帧
+            ENTERED();
             break;
         }
         case OP_METHOD:
@@ -505,7 +681,7 @@ static InterpretResult run()
                 uint8_t index = READ_BYTE();
                 if (isLocal)
                 {
-                    closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                    closure->upvalues[i] = UPVALUE_REF(captureUpvalue(frame->slots + index));
                 }
                 else
                 {
@@ -581,6 +757,7 @@ static InterpretResult run()
                 return INTERPRET_RUNTIME_ERROR;
             }
             frame = &vm.frames[vm.frameCount - 1];   // 类似call
+            ENTERED();
             break;
         }
         case OP_CLASS:
@@ -596,6 +773,7 @@ static InterpretResult run()
                 return INTERPRET_RUNTIME_ERROR;
             }
             frame = &vm.frames[vm.frameCount - 1];
+            ENTERED();
             break;
         }
         case OP_GET_SUPER:
@@ -611,6 +789,8 @@ static InterpretResult run()
         }
         case OP_RETURN:
         {
+            if (flight.enabled) flightRecord(FLIGHT_RETURN, vm.frameCount, frame->closure->function->id, 0, 0);
+            PROBE2(function__return, PROBE_FUNCTION_NAME(frame->closure->function), vm.frameCount);
             Value result = pop();
             closeUpvalues(frame->slots);    // 当函数结束的时候，将这个函数用到的上值从常量池中独立出来
             vm.frameCount--;    // vm.frameCount是下一个未被使用的栈帧，--后是当前栈帧
@@ -624,6 +804,7 @@ static InterpretResult run()
             vm.stackTop = frame->slots; // 回到调用当前函数最开始的栈顶
             push(result);
             frame = &vm.frames[vm.frameCount - 1];  // 上一个栈帧
+            SAFEPOINT();
             break;
         }
         }
@@ -632,19 +813,75 @@ static InterpretResult run()
     #undef READ_BYTE
     #undef READ_SHORT
     #undef READ_CONSTANT
+    #undef SAFEPOINT
+    #undef ENTERED
     #undef BINARY_OP
+    #undef INT_ARITH_OP
+    #undef INT_COMPARE_OP
 }
 
-InterpretResult interpret(const char* source)
+static InterpretResult run()
+{
+    return execute(0);
+}
+
+static InterpretResult runTraced()
 {
-    ObjFunction* function = compile(source);
-    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    return execute(EXEC_TRACE);
+}
 
+// --opcode-stats、--coverage、--flight-sample：插桩的这份本来就慢，几个开关在里面运行时判断，不再各编一份
+static InterpretResult runInstrumented()
+{
+    int mode = (debugOptions.traceExecution ? EXEC_TRACE : 0) | (opstats.enabled ? EXEC_COUNT : 0)
+        | (coverage.enabled ? EXEC_COVER : 0) | (flight.enabled && flight.sample > 0 ? EXEC_FLIGHT : 0);
+    InterpretResult result = execute(mode);
+    opstatsPause();
+    return result;
+}
+
+// 把编译好的脚本包成闭包跑起来；放在interpret外面，它的临时值不会跨setjmp
+static InterpretResult runScript(ObjFunction* function)
+{
     push(OBJ_VAL(function));
+    packCode(function);
     ObjClosure* closure = newClosure(function);
     pop();
     push(OBJ_VAL(closure));
     call(closure, 0);  // 设置第一个栈帧
 
+    if (opstats.enabled || coverage.enabled || (flight.enabled && flight.sample > 0)) return runInstrumented();
+    if (debugOptions.traceExecution) return runTraced();
     return run();
+}
+
+InterpretResult interpret(const char* source)
+{
+    // 内存不足时从任意一次分配跳回这里，分配前什么都没改，堆是完好的
+    jmp_buf handler;
+    volatile bool compiling = true;
+    if (setjmp(handler) != 0)
+    {
+        vm.errorJump = NULL;
+        profileState = PROFILE_MUTATOR;
+        profilerDrain();
+        if (compiling) abortCompile();
+        return compiling ? INTERPRET_COMPILE_ERROR : INTERPRET_RUNTIME_ERROR;
+    }
+    vm.errorJump = &handler;
+
+    profileState = PROFILE_COMPILE;
+    ObjFunction* function = byteCache.dir != NULL ? compileCached(source) : compile(source);
+    profileState = PROFILE_MUTATOR;
+    compiling = false;
+    if (function == NULL)
+    {
+        vm.errorJump = NULL;
+        return INTERPRET_COMPILE_ERROR;
+    }
+
+    InterpretResult result = runScript(function);
+    vm.errorJump = NULL;
+    profilerDrain();    // 样本里的函数指针趁现在解析掉，之后的GC可能释放它们
+    return result;
 }
\ No newline at end of file
@@ -0,0 +1,263 @@
+// 用同一组Lox脚本比较几个clox构建：每个脚本在每个构建上先预热再跑若干次，统计耗时中位数、p95和峰值内存
+// 用法：clox_bench [-n 次数] [-w 预热次数] [-j] [-t 阈值%] 构建... -- 脚本...
+//   -j  输出JSON而不是表格
+//   -t  比较模式：第一个构建是基线，其他构建的中位数比基线慢超过阈值就算退化，退出码2
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RUNS_DEFAULT    5
+#define WARMUP_DEFAULT  1
+#define RUNS_MAX        100
+
+typedef struct
+{
+    double median;
+    double p95;
+    long maxRss;        // KB，所有次里最大的
+    bool failed;
+} Result;
+
+typedef struct
+{
+    int runs;
+    int warmup;
+    bool json;
+    double threshold;   // 百分比，小于0表示不比较
+} Options;
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// 跑一次，输出丢掉，返回是否正常退出
+static bool runOnce(const char* program, const char* script, double* seconds, long* maxRss)
+{
+    double start = now();
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        exit(1);
+    }
+
+    if (pid == 0)
+    {
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        dup2(devNull, STDERR_FILENO);
+        execl(program, program, script, (char*)NULL);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0)
+    {
+        perror("wait4");
+        exit(1);
+    }
+
+    *seconds = now() - start;
+    *maxRss = usage.ru_maxrss;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int compareDouble(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static Result measure(const char* program, const char* script, const Options* options)
+{
+    double times[RUNS_MAX];
+    Result result = { 0, 0, 0, false };
+
+    for (int i = 0; i < options->warmup; ++i)   // 预热：页缓存、CPU频率，结果不要
+    {
+        long rss;
+        runOnce(program, script, &times[0], &rss);
+    }
+
+    for (int i = 0; i < options->runs; ++i)
+    {
+        long rss;
+        if (!runOnce(program, script, &times[i], &rss)) result.failed = true;
+        if (rss > result.maxRss) result.maxRss = rss;
+    }
+
+    // 最近秩法取百分位
+    qsort(times, options->runs, sizeof(double), compareDouble);
+    result.median = times[options->runs / 2];
+    result.p95 = times[(options->runs * 95 + 99) / 100 - 1];
+    return result;
+}
+
+static const char* baseName(const char* path)
+{
+    const char* slash = strrchr(path, '/');
+    return slash == NULL ? path : slash + 1;
+}
+
+// 相对基线的变化，百分比
+static double change(const Result* result, const Result* baseline)
+{
+    return baseline->median > 0 ? (result->median / baseline->median - 1) * 100 : 0;
+}
+
+static bool isRegression(const Result* result, const Result* baseline, const Options* options)
+{
+    return options->threshold >= 0 && change(result, baseline) > options->threshold;
+}
+
+// 输出JSON里的字符串，路径里一般不会有特殊字符，还是转义一下
+static void printJsonString(const char* text)
+{
+    putchar('"');
+    for (const char* c = text; *c != '\0'; ++c)
+    {
+        if (*c == '"' || *c == '\\') putchar('\\');
+        putchar(*c);
+    }
+    putchar('"');
+}
+
+static void printJson(const Result* result, const Result* baseline, const char* program, const char* script,
+    const Options* options, bool first)
+{
+    printf(first ? "  {" : ",\n  {");
+    printf("\"program\": ");
+    printJsonString(program);
+    printf(", \"script\": ");
+    printJsonString(baseName(script));
+    printf(", \"runs\": %d, \"median_s\": %.6f, \"p95_s\": %.6f, \"max_rss_kb\": %ld, \"failed\": %s",
+        options->runs, result->median, result->p95, result->maxRss, result->failed ? "true" : "false");
+    if (options->threshold >= 0 && result != baseline)
+    {
+        printf(", \"change_pct\": %.2f, \"regression\": %s", change(result, baseline),
+            isRegression(result, baseline, options) ? "true" : "false");
+    }
+    printf("}");
+}
+
+static void printCell(const Result* result, const Result* baseline, const Options* options)
+{
+    char cell[96];
+    snprintf(cell, sizeof(cell), "%.3fs p95 %.3fs %5.2fx %6.1fMB%s%s", result->median, result->p95,
+        baseline->median > 0 ? result->median / baseline->median : 0, result->maxRss / 1024.0,
+        result->failed ? " FAIL" : "", isRegression(result, baseline, options) ? " SLOWER" : "");
+    printf("  %-40s", cell);
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: clox_bench [-n runs] [-w warmup] [-j] [-t threshold%%] program... -- script...\n");
+    exit(64);
+}
+
+int main(int argc, char* argv[])
+{
+    Options options = { RUNS_DEFAULT, WARMUP_DEFAULT, false, -1 };
+
+    int first = 1;
+    for (; first < argc && argv[first][0] == '-' && strcmp(argv[first], "--") != 0; ++first)
+    {
+        const char* arg = argv[first];
+        if (strcmp(arg, "-j") == 0)
+        {
+            options.json = true;
+            continue;
+        }
+        if (first + 1 >= argc) usage();
+
+        const char* value = argv[++first];
+        if (strcmp(arg, "-n") == 0) options.runs = atoi(value);
+        else if (strcmp(arg, "-w") == 0) options.warmup = atoi(value);
+        else if (strcmp(arg, "-t") == 0) options.threshold = atof(value);
+        else usage();
+    }
+    if (options.runs < 1 || options.runs > RUNS_MAX || options.warmup < 0) usage();
+
+    int separator = first;
+    while (separator < argc && strcmp(argv[separator], "--") != 0) separator++;
+    if (separator == first || separator >= argc - 1) usage();
+
+    char** programs = &argv[first];
+    int programCount = separator - first;
+    char** scripts = &argv[separator + 1];
+    int scriptCount = argc - separator - 1;
+
+    if (options.json)
+    {
+        printf("[\n");
+    }
+    else
+    {
+        // 表头：第一个构建是基准，后面的给出相对耗时
+        printf("%-20s", "workload");
+        for (int p = 0; p < programCount; ++p)
+        {
+            printf("  %-40s", baseName(programs[p]));
+        }
+        printf("\n");
+    }
+
+    bool anyFailed = false;
+    bool anyRegression = false;
+    for (int s = 0; s < scriptCount; ++s)
+    {
+        if (!options.json)
+        {
+            printf("%-20s", baseName(scripts[s]));
+            fflush(stdout);
+        }
+
+        Result baseline;
+        for (int p = 0; p < programCount; ++p)
+        {
+            Result result = measure(programs[p], scripts[s], &options);
+            if (p == 0) baseline = result;
+            const Result* base = p == 0 ? &result : &baseline;
+
+            if (options.json)
+            {
+                printJson(&result, base, programs[p], scripts[s], &options, s == 0 && p == 0);
+            }
+            else
+            {
+                printCell(&result, base, &options);
+            }
+            fflush(stdout);
+
+            anyFailed |= result.failed;
+            anyRegression |= p > 0 && isRegression(&result, &baseline, &options);
+        }
+        if (!options.json) printf("\n");
+    }
+
+    if (options.json)
+    {
+        printf("\n]\n");
+    }
+    else
+    {
+        printf("(median and p95 of %d runs after %d warmup, time relative to %s, peak RSS)\n", options.runs,
+            options.warmup, baseName(programs[0]));
+    }
+
+    if (anyFailed) return 1;
+    return anyRegression ? 2 : 0;
+}
@@ -0,0 +1,267 @@
+// 解码clox --flight写出的飞行记录：按时间顺序打印最后N个事件，
+// 抽样的指令和出错的指令用debug.c的反汇编打印，字节码和常量来自转储里的函数登记数据
+// 用法：clox_flight [-n 条数] 转储
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "debug.h"
+#include "flight.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#define LAST_DEFAULT    50
+
+typedef struct
+{
+    char* name;
+    Chunk chunk;
+} Function;
+
+static Function* functions = NULL;  // 按编号，0号不用
+static uint32_t functionCount = 0;
+
+static void usage()
+{
+    fprintf(stderr, "Usage: clox_flight [-n events] dump\n");
+    exit(64);
+}
+
+static void corrupt()
+{
+    fprintf(stderr, "Flight recorder dump is truncated or corrupt.\n");
+    exit(65);
+}
+
+// 按顺序读登记数据
+typedef struct
+{
+    uint8_t* data;
+    size_t size;
+    size_t position;
+} Reader;
+
+static void readBytes(Reader* reader, void* out, size_t size)
+{
+    if (reader->position + size > reader->size) corrupt();
+    memcpy(out, reader->data + reader->position, size);
+    reader->position += size;
+}
+
+static uint32_t readInt(Reader* reader)
+{
+    uint32_t value;
+    readBytes(reader, &value, sizeof(value));
+    return value;
+}
+
+static char* readString(Reader* reader, uint32_t* length)
+{
+    *length = readInt(reader);
+    if (reader->position + *length > reader->size) corrupt();
+    char* chars = malloc(*length + 1);
+    readBytes(reader, chars, *length);
+    chars[*length] = '\0';
+    return chars;
+}
+
+// 把登记的函数还原成Chunk，常量里的字符串、函数重新建成对象，反汇编打印常量时用
+static void readFunction(Reader* reader)
+{
+    uint32_t id = readInt(reader);
+    if (id >= functionCount)
+    {
+        uint32_t oldCount = functionCount;
+        functionCount = id + 1 > functionCount * 2 ? id + 1 : functionCount * 2;
+        functions = realloc(functions, sizeof(Function) * functionCount);
+        memset(functions + oldCount, 0, sizeof(Function) * (functionCount - oldCount));
+    }
+
+    Function* function = &functions[id];
+    uint32_t length;
+    function->name = readString(reader, &length);
+    initChunk(&function->chunk);
+
+    uint32_t count = readInt(reader);
+    if (reader->position + count > reader->size) corrupt();
+    uint8_t* code = reader->data + reader->position;
+    reader->position += count;
+
+    // 行号表照着写回去：每个字节取它所在那一项的行号
+    uint32_t lineCount = readInt(reader);
+    if (reader->position + (uint64_t)lineCount * sizeof(LineStart) > reader->size) corrupt();
+    LineStart* lines = malloc(sizeof(LineStart) * (lineCount > 0 ? lineCount : 1));
+    readBytes(reader, lines, sizeof(LineStart) * lineCount);
+    uint32_t run = 0;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        while (run + 1 < lineCount && (uint32_t)lines[run + 1].offset <= i) run++;
+        writeChunk(&function->chunk, code[i], lineCount > 0 ? lines[run].line : 0);
+    }
+    free(lines);
+
+    uint32_t constants = readInt(reader);
+    for (uint32_t i = 0; i < constants; ++i)
+    {
+        uint8_t tag;
+        readBytes(reader, &tag, 1);
+
+        Value value = NIL_VAL;
+        if (tag == FLIGHT_CONSTANT_FALSE || tag == FLIGHT_CONSTANT_TRUE)
+        {
+            value = BOOL_VAL(tag == FLIGHT_CONSTANT_TRUE);
+        }
+        else if (tag == FLIGHT_CONSTANT_NUMBER)
+        {
+            double number;
+            readBytes(reader, &number, sizeof(number));
+            value = NUMBER_VAL(number);
+        }
+        else if (tag == FLIGHT_CONSTANT_STRING || tag == FLIGHT_CONSTANT_FUNCTION)
+        {
+            char* chars = readString(reader, &length);
+            ObjString* string = copyString(chars, (int)length);
+            free(chars);
+            if (tag == FLIGHT_CONSTANT_STRING)
+            {
+                value = OBJ_VAL(string);
+            }
+            else
+            {
+                ObjFunction* constant = newFunction();
+                constant->name = string;
+                value = OBJ_VAL(constant);
+            }
+        }
+        addConstant(&function->chunk, value);
+    }
+}
+
+static const char* functionName(uint32_t id)
+{
+    if (id == 0) return "-";
+    if (id >= functionCount || functions[id].name == NULL) return "?";
+    return functions[id].name;
+}
+
+static void printEvent(uint64_t sequence, FlightEvent* event)
+{
+    printf("%10llu %5d ", (unsigned long long)sequence, event->depth);
+    switch (event->kind)
+    {
+        case FLIGHT_CALL:
+            printf("call      %s\n", functionName(event->function));
+            return;
+        case FLIGHT_RETURN:
+            printf("return    %s\n", functionName(event->function));
+            return;
+        case FLIGHT_GC_BEGIN:
+            printf("gc begin  %u KB\n", event->data);
+            return;
+        case FLIGHT_GC_END:
+            printf("gc end    %u KB\n", event->data);
+            return;
+        case FLIGHT_COMPACT:
+            printf("compact   %u KB\n", event->data);
+            return;
+        case FLIGHT_INSTRUCTION:
+        case FLIGHT_ERROR:
+        {
+            const char* kind = event->kind == FLIGHT_ERROR ? "error" : "insn";
+            Function* function = event->function < functionCount ? &functions[event->function] : NULL;
+            if (function == NULL || function->name == NULL || event->offset >= (uint32_t)function->chunk.count)
+            {
+                printf("%-9s %-16s %04u\n", kind, functionName(event->function), event->offset);
+                return;
+            }
+
+            char where[64];
+            snprintf(where, sizeof(where), "%s:%d", function->name, getLine(&function->chunk, (int)event->offset));
+            printf("%-9s %-16s ", kind, where);
+            // 出错时记的是最后读到的那个字节，可能是操作数，退回到它所在指令的开头
+            int offset = 0;
+            while (offset + instructionLength(&function->chunk, offset) <= (int)event->offset)
+            {
+                offset += instructionLength(&function->chunk, offset);
+            }
+            disassembleInstruction(&function->chunk, offset);
+            return;
+        }
+        default:
+            printf("unknown event %d\n", event->kind);
+            return;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int last = LAST_DEFAULT;
+    const char* path = NULL;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) last = atoi(argv[++i]);
+        else if (argv[i][0] != '-' && path == NULL) path = argv[i];
+        else usage();
+    }
+    if (path == NULL || last < 1) usage();
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return 74;
+    }
+
+    FlightHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, FLIGHT_MAGIC, sizeof(FLIGHT_MAGIC)) != 0
+        || header.capacity == 0 || (header.capacity & (header.capacity - 1)) != 0)
+    {
+        fprintf(stderr, "\"%s\" is not a clox flight recorder dump.\n", path);
+        return 65;
+    }
+
+    FlightEvent* events = malloc(sizeof(FlightEvent) * header.capacity);
+    Reader reader = { malloc(header.symbolsSize > 0 ? header.symbolsSize : 1), header.symbolsSize, 0 };
+    if (fread(events, sizeof(FlightEvent), header.capacity, file) != header.capacity
+        || fread(reader.data, 1, header.symbolsSize, file) != header.symbolsSize)
+    {
+        corrupt();
+    }
+    fclose(file);
+
+    initVM();
+    vm.nextGC = SIZE_MAX;   // 还原出来的常量没有根，解码期间不回收
+    while (reader.position < reader.size)
+    {
+        readFunction(&reader);
+    }
+
+    header.message[FLIGHT_MESSAGE - 1] = '\0';
+    if (header.reason == 0) printf("Runtime error: %s\n", header.message);
+    else printf("Fatal signal %d\n", header.reason);
+
+    uint64_t available = header.head < header.capacity ? header.head : header.capacity;
+    uint64_t shown = available < (uint64_t)last ? available : (uint64_t)last;
+    printf("%llu events recorded, last %llu:\n\n%10s %5s event\n", (unsigned long long)header.head,
+        (unsigned long long)shown, "seq", "depth");
+
+    for (uint64_t sequence = header.head - shown; sequence < header.head; ++sequence)
+    {
+        printEvent(sequence, &events[sequence & (header.capacity - 1)]);
+    }
+
+    for (uint32_t id = 0; id < functionCount; ++id)
+    {
+        if (functions[id].name == NULL) continue;
+        free(functions[id].name);
+        freeChunk(&functions[id].chunk);
+    }
+    free(functions);
+    free(events);
+    free(reader.data);
+    freeVM();
+    return 0;
+}
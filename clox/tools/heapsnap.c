@@ -0,0 +1,416 @@
+// 分析clox --heap-dump或heapDump()写出的堆快照：按类型汇总，算支配树和每个对象的保留大小
+// （它一释放就跟着没人引用的所有对象的字节数），列出保留最多的对象和它们的根路径
+// 用法：clox_heap [-n 条数] [-p id] 快照
+//   -n  列出保留大小最大的前几个对象，默认20
+//   -p  只看一个对象：根路径和支配链
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TOP_DEFAULT     20
+#define PATH_HEAD       4       // 根路径太长时开头和结尾各留几段
+#define PATH_TAIL       8
+
+typedef struct
+{
+    char type[16];
+    size_t size;
+    int parent;                 // 快照里第一次走到它的父对象，根路径沿着它往回走
+    char* label;
+    char* summary;
+} Node;
+
+static Node* nodes = NULL;
+static int nodeCount = 1;       // 0号是根
+static int nodeCapacity = 0;
+
+static int* edgeFrom = NULL;
+static int* edgeTo = NULL;
+static int edgeCount = 0;
+static int edgeCapacity = 0;
+
+// 出边、入边，压缩成按节点分段的数组
+static int* succStart = NULL;
+static int* succ = NULL;
+static int* predStart = NULL;
+static int* pred = NULL;
+
+static int* idom = NULL;
+static size_t* retained = NULL;
+
+static void usage()
+{
+    fprintf(stderr, "Usage: clox_heap [-n top] [-p id] snapshot\n");
+    exit(64);
+}
+
+static void* allocate(size_t size)
+{
+    void* result = calloc(1, size);
+    if (result == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    return result;
+}
+
+static void* grow(void* pointer, size_t size)
+{
+    void* result = realloc(pointer, size);
+    if (result == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    return result;
+}
+
+static void ensureNode(int id)
+{
+    if (id < nodeCapacity) return;
+
+    int oldCapacity = nodeCapacity;
+    while (nodeCapacity <= id) nodeCapacity = nodeCapacity < 1024 ? 1024 : nodeCapacity * 2;
+    nodes = grow(nodes, sizeof(Node) * nodeCapacity);
+    memset(nodes + oldCapacity, 0, sizeof(Node) * (nodeCapacity - oldCapacity));
+}
+
+static void addEdge(int from, int to)
+{
+    if (edgeCount + 1 > edgeCapacity)
+    {
+        edgeCapacity = edgeCapacity < 1024 ? 1024 : edgeCapacity * 2;
+        edgeFrom = grow(edgeFrom, sizeof(int) * edgeCapacity);
+        edgeTo = grow(edgeTo, sizeof(int) * edgeCapacity);
+    }
+    edgeFrom[edgeCount] = from;
+    edgeTo[edgeCount] = to;
+    edgeCount++;
+    ensureNode(to);
+    if (to >= nodeCount) nodeCount = to + 1;
+}
+
+static void readSnapshot(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+
+    char* line = NULL;
+    size_t length = 0;
+    if (getline(&line, &length, file) < 0 || strncmp(line, "lox-heap-snapshot 1", 19) != 0)
+    {
+        fprintf(stderr, "\"%s\" is not a clox heap snapshot.\n", path);
+        exit(65);
+    }
+
+    ensureNode(0);
+    nodes[0].label = strdup("roots");
+    nodes[0].summary = strdup("");
+
+    int current = 0;
+    while (getline(&line, &length, file) >= 0)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        int id;
+        int offset;
+        if (line[0] == 'R' || line[0] == 'E')
+        {
+            if (sscanf(line + 2, "%d", &id) != 1 || id <= 0) continue;
+            addEdge(line[0] == 'R' ? 0 : current, id);
+        }
+        else if (line[0] == 'O')
+        {
+            char type[16];
+            size_t size;
+            int parent;
+            char label[256];
+            if (sscanf(line + 2, "%d %15s %zu %d %255s%n", &id, type, &size, &parent, label, &offset) != 5 || id <= 0)
+            {
+                continue;
+            }
+
+            ensureNode(id);
+            if (id >= nodeCount) nodeCount = id + 1;
+            Node* node = &nodes[id];
+            strcpy(node->type, type);
+            node->size = size;
+            node->parent = parent;
+            node->label = strdup(label);
+            node->summary = strdup(line[2 + offset] == ' ' ? line + 3 + offset : line + 2 + offset);
+            current = id;
+        }
+    }
+
+    free(line);
+    fclose(file);
+}
+
+// 按起点分段
+static void buildAdjacency(int** start, int** targets, int* from, int* to)
+{
+    *start = allocate(sizeof(int) * (nodeCount + 1));
+    *targets = allocate(sizeof(int) * (edgeCount > 0 ? edgeCount : 1));
+    for (int i = 0; i < edgeCount; ++i) (*start)[from[i] + 1]++;
+    for (int i = 0; i < nodeCount; ++i) (*start)[i + 1] += (*start)[i];
+
+    int* fill = allocate(sizeof(int) * nodeCount);
+    for (int i = 0; i < edgeCount; ++i)
+    {
+        (*targets)[(*start)[from[i]] + fill[from[i]]++] = to[i];
+    }
+    free(fill);
+}
+
+// 半支配者用Lengauer-Tarjan算（带路径压缩），再按Semi-NCA沿深度优先树往上找直接支配者；
+// 一个类被几十万个实例引用时，简单的迭代求交会在长链上来回走，退化成平方
+// 下面的数组都按深度优先的先序编号（从1开始）索引，0表示没有
+static void computeDominators(int** preorderOut, int* reachedOut)
+{
+    int* number = allocate(sizeof(int) * nodeCount);           // 节点 -> 先序编号
+    int* vertex = allocate(sizeof(int) * (nodeCount + 1));     // 先序编号 -> 节点
+    int* parent = allocate(sizeof(int) * (nodeCount + 1));
+    int* semi = allocate(sizeof(int) * (nodeCount + 1));
+    int* ancestor = allocate(sizeof(int) * (nodeCount + 1));
+    int* label = allocate(sizeof(int) * (nodeCount + 1));
+    int* dominator = allocate(sizeof(int) * (nodeCount + 1));
+    int* stack = allocate(sizeof(int) * (nodeCount + 1));
+    int* cursor = allocate(sizeof(int) * nodeCount);
+
+    // 非递归深度优先，链表之类的深结构不会爆栈
+    int reached = 0;
+    int depth = 0;
+    number[0] = ++reached;
+    vertex[reached] = 0;
+    cursor[0] = succStart[0];
+    stack[depth++] = 0;
+    while (depth > 0)
+    {
+        int node = stack[depth - 1];
+        if (cursor[node] >= succStart[node + 1])
+        {
+            depth--;
+            continue;
+        }
+
+        int next = succ[cursor[node]++];
+        if (number[next] != 0) continue;
+        number[next] = ++reached;
+        vertex[reached] = next;
+        parent[reached] = number[node];
+        cursor[next] = succStart[next];
+        stack[depth++] = next;
+    }
+
+    for (int i = 1; i <= reached; ++i)
+    {
+        semi[i] = i;
+        label[i] = i;
+    }
+
+    for (int w = reached; w >= 2; --w)
+    {
+        int node = vertex[w];
+        for (int p = predStart[node]; p < predStart[node + 1]; ++p)
+        {
+            int v = number[pred[p]];
+            if (v == 0) continue;
+
+            // eval(v)：把v到森林根的路径压缩掉，路径先存进栈里，从靠根的一头往下处理
+            if (ancestor[v] != 0)
+            {
+                int count = 0;
+                for (int x = v; ancestor[ancestor[x]] != 0; x = ancestor[x]) stack[count++] = x;
+                while (count > 0)
+                {
+                    int x = stack[--count];
+                    if (semi[label[ancestor[x]]] < semi[label[x]]) label[x] = label[ancestor[x]];
+                    ancestor[x] = ancestor[ancestor[x]];
+                }
+                v = label[v];
+            }
+            if (semi[v] < semi[w]) semi[w] = semi[v];
+        }
+        ancestor[w] = parent[w];
+    }
+
+    dominator[1] = 1;
+    for (int w = 2; w <= reached; ++w)
+    {
+        int d = parent[w];
+        while (d > semi[w]) d = dominator[d];
+        dominator[w] = d;
+    }
+
+    idom = allocate(sizeof(int) * nodeCount);
+    for (int i = 0; i < nodeCount; ++i) idom[i] = -1;
+    for (int w = 1; w <= reached; ++w)
+    {
+        idom[vertex[w]] = vertex[dominator[w]];
+    }
+
+    free(number);
+    free(parent);
+    free(semi);
+    free(ancestor);
+    free(label);
+    free(dominator);
+    free(stack);
+    free(cursor);
+    *preorderOut = vertex;
+    *reachedOut = reached;
+}
+
+// 支配者的先序编号总比被支配的小，倒着加上去就是保留大小
+static void computeRetained(int* preorder, int reached)
+{
+    retained = allocate(sizeof(size_t) * nodeCount);
+    for (int i = reached; i >= 1; --i)
+    {
+        int node = preorder[i];
+        retained[node] += nodes[node].size;
+        if (node != 0) retained[idom[node]] += retained[node];
+    }
+}
+
+static void printPath(int id)
+{
+    int depth = 0;
+    for (int node = id; node != 0 && depth <= nodeCount; node = nodes[node].parent) depth++;
+
+    int* path = allocate(sizeof(int) * (depth > 0 ? depth : 1));
+    int i = depth;
+    for (int node = id; node != 0 && i > 0; node = nodes[node].parent) path[--i] = node;
+
+    for (i = 0; i < depth; ++i)
+    {
+        if (depth > PATH_HEAD + PATH_TAIL && i == PATH_HEAD)
+        {
+            printf(" -> ... (%d more)", depth - PATH_HEAD - PATH_TAIL);
+            i = depth - PATH_TAIL;
+        }
+        printf("%s%s", i == 0 ? "" : " -> ", nodes[path[i]].label);
+    }
+    free(path);
+}
+
+static void printObject(int id)
+{
+    printf("%8d %-13s %10zu %12zu  %s\n", id, nodes[id].type, nodes[id].size, retained[id], nodes[id].summary);
+    printf("%8s path: ", "");
+    printPath(id);
+    printf("\n");
+}
+
+static int compareRetained(const void* a, const void* b)
+{
+    size_t x = retained[*(const int*)a];
+    size_t y = retained[*(const int*)b];
+    if (x != y) return (y > x) - (y < x);
+    return *(const int*)a - *(const int*)b;
+}
+
+static void reportTypes()
+{
+    char types[32][16];
+    long counts[32] = { 0 };
+    size_t bytes[32] = { 0 };
+    int typeCount = 0;
+    size_t total = 0;
+    int objects = 0;
+
+    for (int id = 1; id < nodeCount; ++id)
+    {
+        if (nodes[id].label == NULL) continue;
+        int type = 0;
+        while (type < typeCount && strcmp(types[type], nodes[id].type) != 0) type++;
+        if (type == typeCount)
+        {
+            if (typeCount == 32) continue;
+            strcpy(types[typeCount++], nodes[id].type);
+        }
+        counts[type]++;
+        bytes[type] += nodes[id].size;
+        total += nodes[id].size;
+        objects++;
+    }
+
+    printf("Objects: %d, bytes: %zu\n\n%-13s %10s %12s %7s\n", objects, total, "type", "objects", "bytes", "%");
+    for (int type = 0; type < typeCount; ++type)
+    {
+        printf("%-13s %10ld %12zu %6.1f%%\n", types[type], counts[type], bytes[type],
+            total > 0 ? 100.0 * bytes[type] / total : 0);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int top = TOP_DEFAULT;
+    int only = -1;
+    const char* path = NULL;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) top = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) only = atoi(argv[++i]);
+        else if (argv[i][0] != '-' && path == NULL) path = argv[i];
+        else usage();
+    }
+    if (path == NULL) usage();
+
+    readSnapshot(path);
+
+    int* reverseFrom = edgeTo;
+    int* reverseTo = edgeFrom;
+    buildAdjacency(&succStart, &succ, edgeFrom, edgeTo);
+    buildAdjacency(&predStart, &pred, reverseFrom, reverseTo);
+
+    int* preorder;
+    int reached;
+    computeDominators(&preorder, &reached);
+    computeRetained(preorder, reached);
+    free(preorder);
+
+    if (only >= 0)
+    {
+        if (only == 0 || only >= nodeCount || nodes[only].label == NULL)
+        {
+            fprintf(stderr, "No object %d in the snapshot.\n", only);
+            return 65;
+        }
+
+        printf("%8s %-13s %10s %12s  summary\n", "id", "type", "self", "retained");
+        printObject(only);
+        printf("\nDominators:\n");
+        for (int node = idom[only]; node > 0; node = idom[node])
+        {
+            printObject(node);
+        }
+        return 0;
+    }
+
+    reportTypes();
+
+    int* order = allocate(sizeof(int) * nodeCount);
+    int count = 0;
+    for (int id = 1; id < nodeCount; ++id)
+    {
+        if (nodes[id].label != NULL && idom[id] >= 0) order[count++] = id;
+    }
+    qsort(order, count, sizeof(int), compareRetained);
+
+    printf("\nTop %d objects by retained size:\n%8s %-13s %10s %12s  summary\n", top, "id", "type", "self",
+        "retained");
+    for (int i = 0; i < count && i < top; ++i)
+    {
+        printObject(order[i]);
+    }
+    free(order);
+    return 0;
+}
@@ -0,0 +1,347 @@
+// 虚拟机内部接口的微基准：直接调哈希表、字符串驻留、字节码数组、GC和词法分析器，
+// 报告每次操作的纳秒数和内存申请次数，改table.c、object.c、memory.c时单独看效果
+// 用法：clox_micro [-r 轮数] [名字...]，给了名字就只跑名字里包含这些子串的项
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chunk.h"
+#include "gc.h"
+#include "memory.h"
+#include "object.h"
+#include "scanner.h"
+#include "table.h"
+#include "vm.h"
+
+#define KEY_COUNT       100000
+#define CHUNK_BYTES     (1 << 20)
+#define GRAPH_DEPTH     17              // 满二叉树，2^17 - 1个实例
+#define GARBAGE_COUNT   200000
+#define SOURCE_REPEAT   2000
+
+// 一轮测量：只有start和stop之间的时间和内存申请算数
+typedef struct
+{
+    double seconds;
+    size_t allocations;
+    size_t bytes;
+    long ops;
+
+    double startTime;
+    size_t startAllocations;
+    size_t startBytes;
+} Timer;
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void startTimer(Timer* timer)
+{
+    timer->startAllocations = gcStats.allocations;
+    timer->startBytes = vm.bytesAllocated;
+    timer->startTime = now();
+}
+
+static void stopTimer(Timer* timer, long ops)
+{
+    timer->seconds += now() - timer->startTime;
+    timer->allocations += gcStats.allocations - timer->startAllocations;
+    if (vm.bytesAllocated > timer->startBytes) timer->bytes += vm.bytesAllocated - timer->startBytes;
+    timer->ops += ops;
+}
+
+// 基准之间不让GC自己插进来，需要回收时显式调
+static void pauseGC()
+{
+    vm.nextGC = SIZE_MAX;
+}
+
+// 栈上没有根，收掉上一项留下的所有对象
+static void cleanHeap()
+{
+    vm.stackTop = vm.stack;
+    collectGarbage();
+    pauseGC();
+}
+
+static ObjString* keys[KEY_COUNT];
+
+// 键都是驻留字符串，根放在栈上也放不下，靠pauseGC保证测量期间不被收掉
+static void makeKeys()
+{
+    char buffer[32];
+    for (int i = 0; i < KEY_COUNT; ++i)
+    {
+        int length = snprintf(buffer, sizeof(buffer), "key%d", i);
+        keys[i] = copyString(buffer, length);
+    }
+}
+
+static void benchTableSet(Timer* timer)
+{
+    makeKeys();
+    Table table;
+    initTable(&table);
+
+    startTimer(timer);
+    for (int i = 0; i < KEY_COUNT; ++i)
+    {
+        tableSet(&table, keys[i], NUMBER_VAL(i));
+    }
+    stopTimer(timer, KEY_COUNT);
+
+    freeTable(&table);
+}
+
+static void benchTableGet(Timer* timer)
+{
+    makeKeys();
+    Table table;
+    initTable(&table);
+    for (int i = 0; i < KEY_COUNT; i += 2)  // 一半命中一半不命中
+    {
+        tableSet(&table, keys[i], NUMBER_VAL(i));
+    }
+
+    Value value;
+    int found = 0;
+    startTimer(timer);
+    for (int i = 0; i < KEY_COUNT; ++i)
+    {
+        found += tableGet(&table, keys[i], &value);
+    }
+    stopTimer(timer, KEY_COUNT);
+
+    if (found != KEY_COUNT / 2) fprintf(stderr, "table_get: found %d keys.\n", found);
+    freeTable(&table);
+}
+
+static void benchTableDelete(Timer* timer)
+{
+    makeKeys();
+    Table table;
+    initTable(&table);
+    for (int i = 0; i < KEY_COUNT; ++i)
+    {
+        tableSet(&table, keys[i], NUMBER_VAL(i));
+    }
+
+    startTimer(timer);
+    for (int i = 0; i < KEY_COUNT; ++i)
+    {
+        tableDelete(&table, keys[i]);
+    }
+    stopTimer(timer, KEY_COUNT);
+
+    freeTable(&table);
+}
+
+// 驻留表里没有，每次都新建字符串
+static void benchCopyStringNew(Timer* timer)
+{
+    char buffer[32];
+    static int serial = 0;
+
+    startTimer(timer);
+    for (int i = 0; i < KEY_COUNT; ++i)
+    {
+        int length = snprintf(buffer, sizeof(buffer), "new%d", serial++);
+        copyString(buffer, length);
+    }
+    stopTimer(timer, KEY_COUNT);
+}
+
+// 驻留表里已有，只查表
+static void benchCopyStringHit(Timer* timer)
+{
+    makeKeys();
+
+    startTimer(timer);
+    for (int i = 0; i < KEY_COUNT; ++i)
+    {
+        copyString(keys[i]->chars, keys[i]->length);
+    }
+    stopTimer(timer, KEY_COUNT);
+}
+
+// 拼接结果和已有字符串重复：申请缓冲区，查到后释放
+static void benchTakeStringHit(Timer* timer)
+{
+    makeKeys();
+
+    startTimer(timer);
+    for (int i = 0; i < KEY_COUNT; ++i)
+    {
+        char* chars = ALLOCATE(char, keys[i]->length + 1);
+        memcpy(chars, keys[i]->chars, keys[i]->length + 1);
+        takeString(chars, keys[i]->length);
+    }
+    stopTimer(timer, KEY_COUNT);
+}
+
+static void benchWriteChunk(Timer* timer)
+{
+    Chunk chunk;
+    initChunk(&chunk);
+
+    startTimer(timer);
+    for (int i = 0; i < CHUNK_BYTES; ++i)
+    {
+        writeChunk(&chunk, (uint8_t)i, i >> 4);
+    }
+    stopTimer(timer, CHUNK_BYTES);
+
+    freeChunk(&chunk);
+}
+
+// 实例组成的满二叉树，字段left、right
+static ObjInstance* buildTree(ObjClass* klass, ObjString* left, ObjString* right, int depth)
+{
+    ObjInstance* node = newInstance(klass);
+    if (depth > 1)
+    {
+        tableSet(&node->fields, left, OBJ_VAL(buildTree(klass, left, right, depth - 1)));
+        tableSet(&node->fields, right, OBJ_VAL(buildTree(klass, left, right, depth - 1)));
+    }
+    return node;
+}
+
+// 存活对象多、垃圾少：标记为主，按每个存活对象算
+static void benchCollectLive(Timer* timer)
+{
+    ObjClass* klass = newClass(copyString("Node", 4));
+    ObjInstance* root = buildTree(klass, copyString("left", 4), copyString("right", 5), GRAPH_DEPTH);
+    push(OBJ_VAL(root));
+
+    long live = (1L << GRAPH_DEPTH) - 1;
+    for (int i = 0; i < 5; ++i)
+    {
+        startTimer(timer);
+        collectGarbage();
+        stopTimer(timer, live);
+    }
+    pauseGC();
+}
+
+// 全是垃圾：清理为主，按每个释放的对象算
+static void benchCollectGarbage(Timer* timer)
+{
+    ObjClass* klass = newClass(copyString("Garbage", 7));
+    for (int i = 0; i < GARBAGE_COUNT; ++i)
+    {
+        newInstance(klass);
+    }
+
+    startTimer(timer);
+    collectGarbage();
+    stopTimer(timer, GARBAGE_COUNT);
+    pauseGC();
+}
+
+static char* source = NULL;
+
+static void benchScanToken(Timer* timer)
+{
+    static const char* text =
+        "class Zoo {\n"
+        "  init() { this.aardvark = 1; this.baboon = \"str\"; }\n"
+        "  ant() { return this.aardvark + 12.5 * 3; }\n"
+        "}\n"
+        "var zoo = Zoo();\n"
+        "for (var i = 0; i < 100; i = i + 1) { if (i >= 10 and !nil) print zoo.ant(); } // comment\n";
+
+    if (source == NULL)
+    {
+        size_t length = strlen(text);
+        source = malloc(length * SOURCE_REPEAT + 1);
+        for (int i = 0; i < SOURCE_REPEAT; ++i)
+        {
+            memcpy(source + length * i, text, length);
+        }
+        source[length * SOURCE_REPEAT] = '\0';
+    }
+
+    initScanner(source);
+    long tokens = 0;
+    startTimer(timer);
+    while (scanToken().type != TOKEN_EOF) tokens++;
+    stopTimer(timer, tokens);
+}
+
+typedef struct
+{
+    const char* name;
+    void (*run)(Timer* timer);
+} Benchmark;
+
+static Benchmark benchmarks[] = {
+    { "table_set", benchTableSet },
+    { "table_get", benchTableGet },
+    { "table_delete", benchTableDelete },
+    { "copy_string_new", benchCopyStringNew },
+    { "copy_string_hit", benchCopyStringHit },
+    { "take_string_hit", benchTakeStringHit },
+    { "write_chunk", benchWriteChunk },
+    { "collect_live", benchCollectLive },
+    { "collect_garbage", benchCollectGarbage },
+    { "scan_token", benchScanToken },
+};
+
+static bool selected(const char* name, int filterCount, char** filters)
+{
+    if (filterCount == 0) return true;
+    for (int i = 0; i < filterCount; ++i)
+    {
+        if (strstr(name, filters[i]) != NULL) return true;
+    }
+    return false;
+}
+
+int main(int argc, char* argv[])
+{
+    int rounds = 3;
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-r") == 0)
+    {
+        rounds = atoi(argv[2]);
+        first = 3;
+    }
+    if (rounds < 1)
+    {
+        fprintf(stderr, "Usage: clox_micro [-r rounds] [name...]\n");
+        return 64;
+    }
+
+    initVM();
+    pauseGC();
+
+    printf("%-18s %12s %10s %12s %12s\n", "benchmark", "ops", "ns/op", "allocs/op", "bytes/op");
+    for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); ++b)
+    {
+        if (!selected(benchmarks[b].name, argc - first, &argv[first])) continue;
+
+        // 取最快的一轮，减少噪声
+        Timer best = { 0 };
+        for (int r = 0; r < rounds; ++r)
+        {
+            Timer timer = { 0 };
+            benchmarks[b].run(&timer);
+            cleanHeap();
+
+            if (r == 0 || timer.seconds / timer.ops < best.seconds / best.ops) best = timer;
+        }
+
+        printf("%-18s %12ld %10.1f %12.4g %12.1f\n", benchmarks[b].name, best.ops, best.seconds * 1e9 / best.ops,
+            (double)best.allocations / best.ops, (double)best.bytes / best.ops);
+    }
+
+    free(source);
+    freeVM();
+    return 0;
+}